@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 #include <random>
@@ -32,6 +33,9 @@ int blit_debugf(const char * psFormatString, va_list args)
 // blit screenmode callback
 blit::ScreenMode _mode = blit::ScreenMode::lores;
 blit::Surface &set_screen_mode(blit::ScreenMode new_mode) {
+	// keep any damage tracker attached by the game, the new mode needs a full update
+	blit::DamageTracker *damage = blit::screen.damage;
+
 	_mode = new_mode;
     switch(_mode) {
       case blit::ScreenMode::lores:
@@ -45,11 +49,21 @@ blit::Surface &set_screen_mode(blit::ScreenMode new_mode) {
         break;
     }
 
+	if (damage) {
+		blit::screen.damage = damage;
+		damage->add_all();
+	}
+
 	return blit::screen;
 }
 
 static void set_screen_palette(const blit::Pen *colours, int num_cols) {
 	memcpy(palette, colours, num_cols * sizeof(blit::Pen));
+
+	// paletted pixels are converted on upload so every pixel may have changed
+	if (blit::screen.damage) {
+		blit::screen.damage->add_all();
+	}
 }
 
 // blit timer callback
@@ -94,6 +108,97 @@ uint32_t get_max_us_timer()
 	return UINT32_MAX;
 }
 
+// worker pool for parallel rendering
+static const int max_workers = 8;
+static SDL_Thread *t_workers[max_workers];
+static int num_workers = 0;
+static bool workers_running = false;
+
+static SDL_sem *s_work_start = nullptr;
+static SDL_sem *s_work_done = nullptr;
+
+// current job, only changed while the workers are idle
+static SDL_atomic_t work_next;
+static uint32_t work_count = 0;
+static void (*work_func)(void *data, uint32_t index) = nullptr;
+static void *work_data = nullptr;
+
+static void run_work() {
+	uint32_t index;
+	while ((index = SDL_AtomicAdd(&work_next, 1)) < work_count) {
+		work_func(work_data, index);
+	}
+}
+
+static int worker_thread(void *ptr) {
+	while (true) {
+		SDL_SemWait(s_work_start);
+		if(!workers_running) break;
+		run_work();
+		SDL_SemPost(s_work_done);
+	}
+	return 0;
+}
+
+// blit parallel_for callback, the calling thread takes part in the work too
+static void parallel_for(uint32_t count, void (*func)(void *data, uint32_t index), void *data) {
+	work_count = count;
+	work_func = func;
+	work_data = data;
+	SDL_AtomicSet(&work_next, 0);
+
+	int wake = std::min(num_workers, int(count) - 1);
+	for (int i = 0; i < wake; i++) {
+		SDL_SemPost(s_work_start);
+	}
+
+	run_work();
+
+	// join before anything reads the framebuffer
+	for (int i = 0; i < wake; i++) {
+		SDL_SemWait(s_work_done);
+	}
+}
+
+static void start_workers() {
+	num_workers = std::min(SDL_GetCPUCount() - 1, max_workers);
+	if (num_workers <= 0) {
+		num_workers = 0;
+		return;
+	}
+
+	s_work_start = SDL_CreateSemaphore(0);
+	s_work_done = SDL_CreateSemaphore(0);
+	workers_running = true;
+
+	for (int i = 0; i < num_workers; i++) {
+		t_workers[i] = SDL_CreateThread(worker_thread, "Render", nullptr);
+	}
+
+	blit::api.parallel_for = ::parallel_for;
+}
+
+static void stop_workers() {
+	if (!num_workers) {
+		return;
+	}
+
+	blit::api.parallel_for = nullptr;
+	workers_running = false;
+
+	for (int i = 0; i < num_workers; i++) {
+		SDL_SemPost(s_work_start);
+	}
+
+	for (int i = 0; i < num_workers; i++) {
+		SDL_WaitThread(t_workers[i], nullptr);
+	}
+
+	SDL_DestroySemaphore(s_work_start);
+	SDL_DestroySemaphore(s_work_done);
+	num_workers = 0;
+}
+
 // SDL events
 const Uint32 System::timer_event = SDL_RegisterEvents(2);
 const Uint32 System::loop_event = System::timer_event + 1;
@@ -168,6 +273,8 @@ void System::run() {
 #ifdef __EMSCRIPTEN__
 	::init();
 #else
+	start_workers();
+
 	t_system_loop = SDL_CreateThread(system_loop_thread, "Loop", (void *)this);
 	t_system_timer = SDL_CreateThread(system_timer_thread, "Timer", (void *)this);
 #endif
@@ -236,26 +343,52 @@ Uint32 System::mode() {
 	return _mode;
 }
 
-void System::update_texture(SDL_Texture *texture) {
-	blit::render(::now());
+// upload an area of the framebuffer to the texture
+static void update_texture_rect(SDL_Texture *texture, const blit::Rect &r) {
+	SDL_Rect rect = {r.x, r.y, r.w, r.h};
+
 	if (_mode == blit::ScreenMode::lores) {
-		SDL_UpdateTexture(texture, nullptr, __fb_lores.data, 160 * 3);
+		SDL_UpdateTexture(texture, &rect, __fb_lores.ptr(r), 160 * 3);
 	}
 	else if(_mode == blit::ScreenMode::hires) {
-		SDL_UpdateTexture(texture, nullptr, __fb_hires.data, 320 * 3);
+		SDL_UpdateTexture(texture, &rect, __fb_hires.ptr(r), 320 * 3);
 	} else {
 		uint8_t col_fb[320 * 240 * 3];
 
-		auto in = __fb_hires_pal.data, out = col_fb;
+		for(int y = 0; y < r.h; y++) {
+			auto in = __fb_hires_pal.ptr(r.x, r.y + y), out = col_fb + y * r.w * 3;
 
-		for(int i = 0; i < 320 * 240; i++) {
-			uint8_t index = *(in++);
-			(*out++) = palette[index].r;
-			(*out++) = palette[index].g;
-			(*out++) = palette[index].b;
+			for(int x = 0; x < r.w; x++) {
+				uint8_t index = *(in++);
+				(*out++) = palette[index].r;
+				(*out++) = palette[index].g;
+				(*out++) = palette[index].b;
+			}
 		}
 
-		SDL_UpdateTexture(texture, nullptr, col_fb, 320 * 3);
+		SDL_UpdateTexture(texture, &rect, col_fb, r.w * 3);
+	}
+}
+
+void System::update_texture(SDL_Texture *texture) {
+	blit::render(::now());
+
+	blit::Rect full(0, 0, blit::screen.bounds.w, blit::screen.bounds.h);
+	blit::DamageTracker *damage = blit::screen.damage;
+
+	if (!damage || damage->all) {
+		update_texture_rect(texture, full);
+	} else {
+		for (uint8_t i = 0; i < damage->count; i++) {
+			blit::Rect r = full.intersection(damage->rects[i]);
+			if (!r.empty()) {
+				update_texture_rect(texture, r);
+			}
+		}
+	}
+
+	if (damage) {
+		damage->reset();
 	}
 }
 
@@ -302,4 +435,6 @@ void System::stop() {
 
 	SDL_SemPost(s_timer_stop);
 	SDL_WaitThread(t_system_timer, &returnValue);
+
+	stop_workers();
 }
@@ -340,6 +340,7 @@ void blit_init() {
     blit::api.decode_jpeg_buffer = blit_decode_jpeg_buffer;
     blit::api.decode_jpeg_file = blit_decode_jpeg_file;
 
+    blit::api.parallel_for = nullptr;
 
   display::init();
   
@@ -66,6 +66,9 @@ namespace display {
   }
 
   Surface &set_screen_mode(ScreenMode new_mode) {
+    // keep any damage tracker attached by the game, the new mode needs a full flip
+    DamageTracker *damage = screen.damage;
+
     mode = new_mode;
     switch(mode) {
       case ScreenMode::lores:
@@ -79,6 +82,11 @@ namespace display {
         break;
     }
 
+    if(damage) {
+      screen.damage = damage;
+      damage->add_all();
+    }
+
     update_ltdc_for_mode();
     return screen;
   }
@@ -89,25 +97,28 @@ namespace display {
     palette_needs_update = num_cols;
   }
 
-  void dma2d_hires_flip(const Surface &source) {
-    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(source.data), 320 * 240 * 3); 
+  void dma2d_hires_flip(const Surface &source, const Rect &r) {
+    uint32_t start = (r.x + r.y * 320) * 3;
+    uint32_t size = r.h * 320 * 3;
+
+    SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(source.data + r.y * 320 * 3), size); 
 
     // set the transform type (clear bits 17..16 of control register)
     DMA2D->CR &= 0xfcff;
-    // set target pixel format (clear bits 3..0 of foreground format register)
-    DMA2D->FGPFCCR &= 0xfff0;
+    // set source pixel format to RGB888 (bits 3..0 of foreground format register)
+    DMA2D->FGPFCCR = (DMA2D->FGPFCCR & 0xfff0) | 0x1;
     // set source buffer address
-    DMA2D->FGMAR = (uintptr_t)source.data; 
-    // set target pixel format (clear bits 3..0 of output format register)
-    DMA2D->OPFCCR &= 0xfff0;
+    DMA2D->FGMAR = (uintptr_t)(source.data + start); 
+    // set target pixel format to RGB888 (bits 3..0 of output format register)
+    DMA2D->OPFCCR = (DMA2D->OPFCCR & 0xfff0) | 0x1;
     // set target buffer address
-    DMA2D->OMAR = (uintptr_t)&__ltdc_start;
+    DMA2D->OMAR = (uintptr_t)(&__ltdc_start + start);
     // set the number of pixels per line and number of lines    
-    DMA2D->NLR = (320 << 16) | (240);
+    DMA2D->NLR = (r.w << 16) | (r.h);
     // set the source offset
-    DMA2D->FGOR = 0;
+    DMA2D->FGOR = 320 - r.w;
     // set the output offset
-    DMA2D->OOR = 0;
+    DMA2D->OOR = 320 - r.w;
     // trigger start of dma2d transfer
     DMA2D->CR |= DMA2D_CR_START;
 
@@ -146,6 +157,56 @@ namespace display {
     }*/
   }
 
+  void update_palette() {
+    if(palette_needs_update && palette_update_delay-- == 0) {
+      for(int i = 0; i < palette_needs_update; i++) {
+        LTDC_Layer1->CLUTWR = (i << 24) | (palette[i].b << 16) | (palette[i].g << 8) | palette[i].r;
+      }
+
+      LTDC->SRCR = LTDC_SRCR_IMR;
+      palette_needs_update = 0;
+    }
+  }
+
+  // copy an area of the framebuffer to the ltdc buffer
+  void flip_rect(const Surface &source, const Rect &r) {
+    if(mode == ScreenMode::lores) {
+      // pixel double the area, rows and columns in the ltdc buffer are doubled
+      for(int32_t y = r.y; y < r.y + r.h; y++) {
+        uint8_t *s = source.data + (r.x + y * 160) * 3;
+        uint8_t *d = (uint8_t *)(&__ltdc_start) + (r.x * 2 + y * 2 * 320) * 3;
+        uint8_t *row = d;
+
+        for(int32_t x = 0; x < r.w; x++) {
+          *d++ = *(s + 0);
+          *d++ = *(s + 1);
+          *d++ = *(s + 2);
+          *d++ = *(s + 0);
+          *d++ = *(s + 1);
+          *d++ = *(s + 2);
+
+          s += 3;
+        }
+
+        memcpy(row + 320 * 3, row, r.w * 6);
+      }
+
+      SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(&__ltdc_start + r.y * 2 * 320 * 3), r.h * 2 * 320 * 3);
+    } else if(mode == ScreenMode::hires) {
+      dma2d_hires_flip(source, r);
+
+      SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(&__ltdc_start + r.y * 320 * 3), r.h * 320 * 3);
+    } else {
+      uint8_t *ltdc_pal = (uint8_t *)(&__ltdc_start + 320 * 240 * 2);
+
+      for(int32_t y = r.y; y < r.y + r.h; y++) {
+        memcpy(ltdc_pal + r.x + y * 320, source.data + r.x + y * 320, r.w);
+      }
+
+      SCB_CleanInvalidateDCache_by_Addr((uint32_t *)(ltdc_pal + r.y * 320), r.h * 320);
+    }
+  }
+
   void flip(const Surface &source) {        
     static uint32_t flip_time = 0;
 
@@ -154,6 +215,29 @@ namespace display {
 
     uint32_t ltdc_buffer_size = 320 * 240 * 3;
 
+    // only copy the areas that changed if the game tracks them
+    DamageTracker *damage = source.damage;
+    if(damage && !damage->all) {
+      if(mode == ScreenMode::hires_palette) {
+        update_palette();
+      }
+
+      Rect full(0, 0, source.bounds.w, source.bounds.h);
+      for(uint8_t i = 0; i < damage->count; i++) {
+        Rect r = full.intersection(damage->rects[i]);
+        if(!r.empty()) {
+          flip_rect(source, r);
+        }
+      }
+
+      damage->reset();
+      return;
+    }
+
+    if(damage) {
+      damage->reset();
+    }
+
     if(mode == ScreenMode::lores) {
       //dma2d_lores_flip(source);
       //screen.text(std::to_string(flip_time), minimal_font, Point(100,40));
@@ -194,7 +278,7 @@ namespace display {
       //uint32_t flip_start = DWT->CYCCNT;
 
       // perform flip with dma2d transfer
-      dma2d_hires_flip(source);
+      dma2d_hires_flip(source, Rect(0, 0, 320, 240));
 
       /*
         // alternative soft implementation
@@ -215,14 +299,7 @@ namespace display {
       
     } else {
         // paletted
-        if(palette_needs_update && palette_update_delay-- == 0) {
-          for(int i = 0; i < palette_needs_update; i++) {
-            LTDC_Layer1->CLUTWR = (i << 24) | (palette[i].b << 16) | (palette[i].g << 8) | palette[i].r;
-          }
-
-          LTDC->SRCR = LTDC_SRCR_IMR;
-          palette_needs_update = 0;
-        }
+        update_palette();
 
         uint32_t *s = (uint32_t *)source.data;
         uint32_t *d = (uint32_t *)(&__ltdc_start + 320 * 240 * 2);
@@ -13,6 +13,7 @@
 #include "graphics/sprite.hpp"
 #include "graphics/tilemap.hpp"
 #include "graphics/font.hpp"
+#include "graphics/drawlist.hpp"
 #include "math/constants.hpp"
 #include "types/vec3.hpp"
 #include "types/mat4.hpp"
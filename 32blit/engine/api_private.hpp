@@ -53,6 +53,10 @@ namespace blit {
     JPEGImage (*decode_jpeg_buffer)(uint8_t *ptr, uint32_t len);
     JPEGImage (*decode_jpeg_file)(std::string filename);
 
+    // parallel rendering (optional), calls func for every index below count
+    // across the host's worker threads and returns once they have all finished
+    void (*parallel_for)(uint32_t count, void (*func)(void *data, uint32_t index), void *data);
+
   };
   #pragma pack(pop)
 
@@ -3,14 +3,25 @@
 
 #include "surface.hpp"
 
-#ifdef WIN32 
+#ifdef WIN32
 #define __attribute__(A)
 #endif
 
+// vectorised span kernels are used where the target guarantees the
+// instruction set (sse2 on x86-64, neon on armv7-a/aarch64), define
+// BLIT_NO_SIMD to build with the scalar kernels only
+#if !defined(BLIT_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define BLIT_SIMD_SSE2
+#include <emmintrin.h>
+#elif !defined(BLIT_NO_SIMD) && defined(__ARM_NEON)
+#define BLIT_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 // note:
-// for performance reasons none of the blending functions make any attempt 
-// to validate input, adhere to clipping, or source/destination bounds. it 
-// is assumed that all validation has been done by the caller. 
+// for performance reasons none of the blending functions make any attempt
+// to validate input, adhere to clipping, or source/destination bounds. it
+// is assumed that all validation has been done by the caller.
 
 namespace blit {
 
@@ -23,119 +34,444 @@ namespace blit {
   }
 
   __attribute__((always_inline)) inline uint8_t blend(const uint8_t &s, const uint8_t &d, const uint8_t &a) {
-    return d + ((a * (s - d) + 127) >> 8);    
+    return d + ((a * (s - d) + 127) >> 8);
   }
 
-  void RGBA_RGBA(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
-    uint8_t* d = dest->data + (off * 4);
-    uint8_t* m = dest->mask ? dest->mask->data + off : nullptr;    
+  // source pixel fetchers, one per source pixel format. each returns the
+  // colour of the pixel at `s` and is inlined into the span kernels below
+  template<PixelFormat F> struct Source;
 
-    do {
-      uint16_t a = m ? alpha(pen->a, *m++, dest->alpha) : alpha(pen->a, dest->alpha);
+  template<> struct Source<PixelFormat::RGBA> {
+    static const uint8_t stride = 4;
+    __attribute__((always_inline)) static inline Pen fetch(const Surface *, const uint8_t *s) { return *(const Pen *)s; }
+  };
+
+  template<> struct Source<PixelFormat::RGB> {
+    static const uint8_t stride = 3;
+    __attribute__((always_inline)) static inline Pen fetch(const Surface *, const uint8_t *s) { return Pen(s[0], s[1], s[2], 255); }
+  };
+
+  template<> struct Source<PixelFormat::P> {
+    static const uint8_t stride = 1;
+    __attribute__((always_inline)) static inline Pen fetch(const Surface *src, const uint8_t *s) { return src->palette[*s]; }
+  };
+
+  // combined alpha of a pixel, `MASK` and `GALPHA` are resolved at compile
+  // time so the untaken paths vanish from the inner loops
+  template<bool MASK, bool GALPHA>
+  __attribute__((always_inline)) inline uint32_t span_alpha(const uint8_t &a, const uint8_t *m, const uint8_t &ga) {
+    if (MASK)
+      return GALPHA ? alpha(a, *m, ga) : alpha(a, *m);
+
+    return alpha(a, GALPHA ? ga : 255);
+  }
+
+  // blends a single colour into a destination pixel of format `D`
+  template<PixelFormat D>
+  __attribute__((always_inline)) inline void blend_pixel(const Pen &c, uint8_t *d, const uint32_t &a) {
+    if (a >= 255) {
+      d[0] = c.r; d[1] = c.g; d[2] = c.b;
+      if (D == PixelFormat::RGBA)
+        d[3] = c.a;
+    } else if (a > 0) {
+      d[0] = blend(c.r, d[0], a);
+      d[1] = blend(c.g, d[1], a);
+      d[2] = blend(c.b, d[2], a);
+      if (D == PixelFormat::RGBA)
+        d[3] = blend(c.a, d[3], a);
+    }
+  }
+
+
+#ifdef BLIT_SIMD_SSE2
+  // all of the vector kernels below are bit-exact with blend(), the signed
+  // `a * (s - d)` term is split into two unsigned 16-bit products and the
+  // floor of their difference rebuilt from the high and low bytes
+
+  __attribute__((always_inline)) inline __m128i blend_epi16(const __m128i &s, const __m128i &d, const __m128i &a) {
+    const __m128i lo = _mm_set1_epi16(0xff);
+
+    __m128i u = _mm_add_epi16(_mm_mullo_epi16(a, s), _mm_set1_epi16(127));
+    __m128i v = _mm_mullo_epi16(a, d);
+    __m128i r = _mm_add_epi16(d, _mm_sub_epi16(_mm_srli_epi16(u, 8), _mm_srli_epi16(v, 8)));
+    return _mm_add_epi16(r, _mm_cmplt_epi16(_mm_and_si128(u, lo), _mm_and_si128(v, lo)));
+  }
+
+  __attribute__((always_inline)) inline __m128i blend_epi8(const __m128i &s, const __m128i &d, const __m128i &a) {
+    const __m128i zero = _mm_setzero_si128();
+
+    return _mm_packus_epi16(
+      blend_epi16(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), a),
+      blend_epi16(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), a));
+  }
+
+  __attribute__((always_inline)) inline __m128i select_si128(const __m128i &m, const __m128i &a, const __m128i &b) {
+    return _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, b));
+  }
+
+  // blends a constant source with constant alpha, the invariant `a * s + 127`
+  // products are split into their high and low bytes up front so only the
+  // destination product is computed per pixel
+  struct ConstBlend {
+    __m128i u_hi[2], u_lo[2], a;
+
+    ConstBlend(const __m128i &s, const uint32_t &alpha) {
+      const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(127), lo = _mm_set1_epi16(0xff);
+      a = _mm_set1_epi16(alpha);
+
+      __m128i u0 = _mm_add_epi16(_mm_mullo_epi16(a, _mm_unpacklo_epi8(s, zero)), bias);
+      __m128i u1 = _mm_add_epi16(_mm_mullo_epi16(a, _mm_unpackhi_epi8(s, zero)), bias);
+      u_hi[0] = _mm_srli_epi16(u0, 8); u_lo[0] = _mm_and_si128(u0, lo);
+      u_hi[1] = _mm_srli_epi16(u1, 8); u_lo[1] = _mm_and_si128(u1, lo);
+    }
+
+    __attribute__((always_inline)) inline __m128i blend(const int &i, const __m128i &d) const {
+      __m128i v = _mm_mullo_epi16(a, d);
+      __m128i r = _mm_add_epi16(d, _mm_sub_epi16(u_hi[i], _mm_srli_epi16(v, 8)));
+      return _mm_add_epi16(r, _mm_cmplt_epi16(u_lo[i], _mm_and_si128(v, _mm_set1_epi16(0xff))));
+    }
+
+    __attribute__((always_inline)) inline __m128i operator()(const __m128i &d) const {
+      const __m128i zero = _mm_setzero_si128();
+      return _mm_packus_epi16(blend(0, _mm_unpacklo_epi8(d, zero)), blend(1, _mm_unpackhi_epi8(d, zero)));
+    }
+  };
+
+  // blends a constant pen with constant alpha over 16 pixel blocks, returns
+  // the number of pixels processed
+  template<PixelFormat D>
+  uint32_t simd_pen_span(const Pen &c, uint8_t *d, const uint32_t &a, const uint32_t &cnt) {
+    const uint32_t n = cnt & ~15;
+    __m128i *dv = (__m128i *)d;
+    __m128i *end = (__m128i *)(d + n * (D == PixelFormat::RGBA ? 4 : 3));
+
+    if (D == PixelFormat::RGB) {
+      uint8_t pattern[48];
+      for (int i = 0; i < 48; i += 3) {
+        pattern[i + 0] = c.r; pattern[i + 1] = c.g; pattern[i + 2] = c.b;
+      }
+
+      const __m128i p0 = _mm_loadu_si128((const __m128i *)(pattern + 0));
+      const __m128i p1 = _mm_loadu_si128((const __m128i *)(pattern + 16));
+      const __m128i p2 = _mm_loadu_si128((const __m128i *)(pattern + 32));
 
       if (a >= 255) {
-        *d++ = pen->r; *d++ = pen->g; *d++ = pen->b; d++;
-      } else if (a > 0) {
-        *d = blend(pen->r, *d, a); d++;
-        *d = blend(pen->g, *d, a); d++;
-        *d = blend(pen->b, *d, a); d++;
-        *d = blend(pen->a, *d, a); d++;
-      }else{
-        d += 4;
+        for (; dv < end; dv += 3) {
+          _mm_storeu_si128(dv + 0, p0);
+          _mm_storeu_si128(dv + 1, p1);
+          _mm_storeu_si128(dv + 2, p2);
+        }
+      } else {
+        const ConstBlend b0(p0, a), b1(p1, a), b2(p2, a);
+        for (; dv < end; dv += 3) {
+          _mm_storeu_si128(dv + 0, b0(_mm_loadu_si128(dv + 0)));
+          _mm_storeu_si128(dv + 1, b1(_mm_loadu_si128(dv + 1)));
+          _mm_storeu_si128(dv + 2, b2(_mm_loadu_si128(dv + 2)));
+        }
       }
-    } while (--cnt);
+    } else {
+      int32_t pc; memcpy(&pc, &c, 4);
+      const __m128i p = _mm_set1_epi32(pc);
+
+      if (a >= 255) {
+        for (; dv < end; dv++)
+          _mm_storeu_si128(dv, p);
+      } else {
+        const ConstBlend b(p, a);
+        for (; dv < end; dv++)
+          _mm_storeu_si128(dv, b(_mm_loadu_si128(dv)));
+      }
+    }
+
+    return n;
   }
 
-  void RGBA_RGB(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
-    uint8_t* d = dest->data + (off * 3);
-    uint8_t* m = dest->mask ? dest->mask->data + off : nullptr;    
-  
-    do {
-      uint16_t a = m ? alpha(pen->a, *m++, dest->alpha) : alpha(pen->a, dest->alpha);
+  // blends two rgba source pixels (unpacked to 16-bit lanes) using their
+  // own alpha, fully opaque pixels are copied instead
+  template<bool GALPHA>
+  __attribute__((always_inline)) inline __m128i blend_pixels_epi16(const __m128i &s, const __m128i &d, const __m128i &ga1) {
+    __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s, 0xff), 0xff);
+    a = _mm_add_epi16(a, _mm_set1_epi16(1));
+    if (GALPHA)
+      a = _mm_srli_epi16(_mm_mullo_epi16(a, ga1), 8);
 
-      if (a >= 255) {
-        *d++ = pen->r; *d++ = pen->g; *d++ = pen->b;
-      } else if (a > 0) {
-        *d = blend(pen->r, *d, a); d++;
-        *d = blend(pen->g, *d, a); d++;
-        *d = blend(pen->b, *d, a); d++;
-      }else{
-        d += 3;
-      }       
-    } while (--cnt);
+    __m128i opaque = _mm_cmpgt_epi16(a, _mm_set1_epi16(254));
+    __m128i r = blend_epi16(s, d, _mm_min_epi16(a, _mm_set1_epi16(255)));
+
+    return select_si128(opaque, s, r);
   }
 
-  void P_P(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
-    uint8_t* d = dest->data + off;
+  // blends rgba source pixels over 4 pixel blocks, returns the number of
+  // pixels processed. rgb destinations are accessed as overlapping 32-bit
+  // words so one pixel past the block must exist
+  template<PixelFormat D, bool GALPHA>
+  uint32_t simd_blit_span_RGBA(const uint8_t *s, uint8_t *d, const uint8_t &ga, const uint32_t &cnt) {
+    const uint32_t stride = D == PixelFormat::RGBA ? 4 : 3;
+    const uint32_t n = D == PixelFormat::RGBA ? cnt & ~3 : (cnt - 1) & ~3;
 
-    do {
-      if (pen->a != 0) {
-        *d = pen->a;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ga1 = _mm_set1_epi16(ga + 1);
+
+    for (uint32_t i = 0; i < n; i += 4, s += 16, d += 4 * stride) {
+      __m128i sv = _mm_loadu_si128((const __m128i *)s);
+      __m128i dv;
+
+      if (D == PixelFormat::RGBA) {
+        dv = _mm_loadu_si128((const __m128i *)d);
+      } else {
+        int32_t w[4];
+        memcpy(&w[0], d + 0, 4); memcpy(&w[1], d + 3, 4);
+        memcpy(&w[2], d + 6, 4); memcpy(&w[3], d + 9, 4);
+        dv = _mm_loadu_si128((const __m128i *)w);
+      }
+
+      __m128i r = _mm_packus_epi16(
+        blend_pixels_epi16<GALPHA>(_mm_unpacklo_epi8(sv, zero), _mm_unpacklo_epi8(dv, zero), ga1),
+        blend_pixels_epi16<GALPHA>(_mm_unpackhi_epi8(sv, zero), _mm_unpackhi_epi8(dv, zero), ga1));
+
+      if (D == PixelFormat::RGBA) {
+        _mm_storeu_si128((__m128i *)d, r);
+      } else {
+        uint8_t w[16];
+        _mm_storeu_si128((__m128i *)w, r);
+        memcpy(d + 0, w + 0, 3); memcpy(d + 3, w + 4, 3);
+        memcpy(d + 6, w + 8, 3); memcpy(d + 9, w + 12, 3);
+      }
+    }
+
+    return n;
+  }
+#endif
+
+#ifdef BLIT_SIMD_NEON
+  // bit-exact with blend(), see the sse2 implementation above
+  __attribute__((always_inline)) inline uint8x16_t blend_u8(const uint8x16_t &s, const uint8x16_t &d, const uint8x16_t &a) {
+    const uint16x8_t bias = vdupq_n_u16(127);
+
+    uint16x8_t ul = vmlal_u8(bias, vget_low_u8(a), vget_low_u8(s));
+    uint16x8_t uh = vmlal_u8(bias, vget_high_u8(a), vget_high_u8(s));
+    uint16x8_t vl = vmull_u8(vget_low_u8(a), vget_low_u8(d));
+    uint16x8_t vh = vmull_u8(vget_high_u8(a), vget_high_u8(d));
+
+    uint8x16_t u_hi = vcombine_u8(vshrn_n_u16(ul, 8), vshrn_n_u16(uh, 8));
+    uint8x16_t u_lo = vcombine_u8(vmovn_u16(ul), vmovn_u16(uh));
+    uint8x16_t v_hi = vcombine_u8(vshrn_n_u16(vl, 8), vshrn_n_u16(vh, 8));
+    uint8x16_t v_lo = vcombine_u8(vmovn_u16(vl), vmovn_u16(vh));
+
+    return vaddq_u8(vsubq_u8(vaddq_u8(d, u_hi), v_hi), vcltq_u8(u_lo, v_lo));
+  }
+
+  template<PixelFormat D>
+  uint32_t simd_pen_span(const Pen &c, uint8_t *d, const uint32_t &a, const uint32_t &cnt) {
+    const uint32_t n = cnt & ~15;
+    const uint8x16_t av = vdupq_n_u8(a >= 255 ? 255 : a);
+    const uint8x16_t r = vdupq_n_u8(c.r), g = vdupq_n_u8(c.g), b = vdupq_n_u8(c.b), pa = vdupq_n_u8(c.a);
+
+    for (uint32_t i = 0; i < n; i += 16) {
+      if (D == PixelFormat::RGB) {
+        uint8x16x3_t dv;
+        if (a >= 255) {
+          dv.val[0] = r; dv.val[1] = g; dv.val[2] = b;
+        } else {
+          dv = vld3q_u8(d);
+          dv.val[0] = blend_u8(r, dv.val[0], av);
+          dv.val[1] = blend_u8(g, dv.val[1], av);
+          dv.val[2] = blend_u8(b, dv.val[2], av);
+        }
+        vst3q_u8(d, dv);
+        d += 48;
+      } else {
+        uint8x16x4_t dv;
+        if (a >= 255) {
+          dv.val[0] = r; dv.val[1] = g; dv.val[2] = b; dv.val[3] = pa;
+        } else {
+          dv = vld4q_u8(d);
+          dv.val[0] = blend_u8(r, dv.val[0], av);
+          dv.val[1] = blend_u8(g, dv.val[1], av);
+          dv.val[2] = blend_u8(b, dv.val[2], av);
+          dv.val[3] = blend_u8(pa, dv.val[3], av);
+        }
+        vst4q_u8(d, dv);
+        d += 64;
+      }
+    }
+
+    return n;
+  }
+
+  template<PixelFormat D, bool GALPHA>
+  uint32_t simd_blit_span_RGBA(const uint8_t *s, uint8_t *d, const uint8_t &ga, const uint32_t &cnt) {
+    const uint32_t n = cnt & ~15;
+
+    for (uint32_t i = 0; i < n; i += 16, s += 64) {
+      uint8x16x4_t sv = vld4q_u8(s);
+
+      // combined alpha saturated to 255, saturated lanes are opaque
+      uint8x16_t a;
+      if (GALPHA) {
+        uint16x8_t al = vshrq_n_u16(vmulq_n_u16(vaddw_u8(vdupq_n_u16(1), vget_low_u8(sv.val[3])), ga + 1), 8);
+        uint16x8_t ah = vshrq_n_u16(vmulq_n_u16(vaddw_u8(vdupq_n_u16(1), vget_high_u8(sv.val[3])), ga + 1), 8);
+        a = vcombine_u8(vqmovn_u16(al), vqmovn_u16(ah));
+      } else {
+        a = vqaddq_u8(sv.val[3], vdupq_n_u8(1));
+      }
+      uint8x16_t opaque = vceqq_u8(a, vdupq_n_u8(255));
+
+      if (D == PixelFormat::RGB) {
+        uint8x16x3_t dv = vld3q_u8(d);
+        for (int ch = 0; ch < 3; ch++)
+          dv.val[ch] = vbslq_u8(opaque, sv.val[ch], blend_u8(sv.val[ch], dv.val[ch], a));
+        vst3q_u8(d, dv);
+        d += 48;
+      } else {
+        uint8x16x4_t dv = vld4q_u8(d);
+        for (int ch = 0; ch < 4; ch++)
+          dv.val[ch] = vbslq_u8(opaque, sv.val[ch], blend_u8(sv.val[ch], dv.val[ch], a));
+        vst4q_u8(d, dv);
+        d += 64;
+      }
+    }
+
+    return n;
+  }
+#endif
+
+#if defined(BLIT_SIMD_SSE2) || defined(BLIT_SIMD_NEON)
+#define BLIT_SIMD
+#endif
+
+
+  // opaque fills, the pen replaces the destination pixels outright so they
+  // reduce to pattern stores: 32-bit words for rgba and three words per four
+  // pixels for rgb
+
+  template<PixelFormat D>
+  void fill_span(const Pen &c, uint8_t *d, uint32_t cnt) {
+    if (D == PixelFormat::RGBA) {
+      uint32_t w; memcpy(&w, &c, 4);
+      do {
+        memcpy(d, &w, 4); d += 4;
+      } while (--cnt);
+    } else {
+      const uint8_t pattern[12] = {c.r, c.g, c.b, c.r, c.g, c.b, c.r, c.g, c.b, c.r, c.g, c.b};
+      uint32_t w[3]; memcpy(w, pattern, 12);
+
+      for (; cnt >= 4; cnt -= 4, d += 12) {
+        memcpy(d + 0, &w[0], 4);
+        memcpy(d + 4, &w[1], 4);
+        memcpy(d + 8, &w[2], 4);
+      }
+
+      for (; cnt; cnt--, d += 3) {
+        d[0] = c.r; d[1] = c.g; d[2] = c.b;
+      }
+    }
+  }
+
+
+  // pen span kernels, instantiated per destination format, mask presence,
+  // and whether global alpha is in play (`GALPHA` is false when it is 255)
+
+  template<PixelFormat D, bool MASK, bool GALPHA>
+  void pen_span(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    const uint8_t stride = D == PixelFormat::RGBA ? 4 : 3;
+    const Pen c = *pen;
+    const uint8_t ga = dest->alpha;
+
+    uint8_t* d = dest->data + (off * stride);
+    const uint8_t* m = MASK ? dest->mask->data + off : nullptr;
+
+    if (!MASK) {
+      // alpha is constant over the whole span
+      uint32_t a = span_alpha<false, GALPHA>(c.a, m, ga);
+      if (a == 0)
+        return;
+
+#ifdef BLIT_SIMD
+      uint32_t n = simd_pen_span<D>(c, d, a, cnt);
+      if (n == cnt)
+        return;
+
+      d += n * stride; cnt -= n;
+#endif
+
+      if (a >= 255) {
+        fill_span<D>(c, d, cnt);
+        return;
       }
-      d++;
+
+      do {
+        blend_pixel<D>(c, d, a);
+        d += stride;
+      } while (--cnt);
+
+      return;
+    }
+
+    do {
+      blend_pixel<D>(c, d, span_alpha<MASK, GALPHA>(c.a, m, ga));
+      d += stride; m++;
     } while (--cnt);
   }
 
-  void M_M(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+  template<bool GALPHA>
+  void pen_span_M(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
     uint8_t* d = dest->data + off;
 
+    if (!GALPHA) {
+      memset(d, pen->a, cnt);
+      return;
+    }
+
     do {
       *d = blend(pen->a, *d, dest->alpha); d++;
     } while (--cnt);
   }
 
+  void pen_span_P(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    // index zero is transparent
+    if (pen->a == 0)
+      return;
 
-  void RGBA_RGBA(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
-    uint8_t* s = src->palette ? src->data + soff : src->data + (soff * 4);
-    uint8_t* d = dest->data + (doff * 3);
-    uint8_t* m = dest->mask ? dest->mask->data + doff : nullptr;    
+    memset(dest->data + off, pen->a, cnt);
+  }
 
-    do {
-      Pen *pen = src->palette ? &src->palette[*s] : (Pen *)s;
 
-      uint16_t a = m ? alpha(pen->a, *m++, dest->alpha) : alpha(pen->a, dest->alpha);
+  // blit span kernels, instantiated per source format, destination format,
+  // mask presence, and whether global alpha is in play
 
-      if (a >= 255) {
-        *d++ = pen->r; *d++ = pen->g; *d++ = pen->b; d++;
-      } else if (a > 0) {
-        *d = blend(pen->r, *d, a); d++;
-        *d = blend(pen->g, *d, a); d++;
-        *d = blend(pen->b, *d, a); d++;
-        *d = blend(pen->b, *d, a); d++;
-      }else{
-        d += 4;
-      }       
-
-      s += src->palette ? 1 : 4;
-    } while (--cnt);
-  }
+  template<PixelFormat S, PixelFormat D, bool MASK, bool GALPHA>
+  void blit_span(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    const uint8_t stride = D == PixelFormat::RGBA ? 4 : 3;
+    const int32_t s_step = src_step * Source<S>::stride;
+    const uint8_t ga = dest->alpha;
 
-  void RGBA_RGB(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
-    uint8_t* s = src->palette ? src->data + soff : src->data + (soff * 4);
-    uint8_t* d = dest->data + (doff * 3);
-    uint8_t* m = dest->mask ? dest->mask->data + doff : nullptr;    
+    const uint8_t* s = src->data + (soff * Source<S>::stride);
+    uint8_t* d = dest->data + (doff * stride);
+    const uint8_t* m = MASK ? dest->mask->data + doff : nullptr;
+
+#ifdef BLIT_SIMD
+    if (S == PixelFormat::RGBA && !MASK && src_step == 1) {
+      uint32_t n = simd_blit_span_RGBA<D, GALPHA>(s, d, ga, cnt);
+      if (n == cnt)
+        return;
+
+      s += n * 4; d += n * stride; cnt -= n;
+    }
+#endif
 
     do {
-      Pen *pen = src->palette ? &src->palette[*s] : (Pen *)s;
+      Pen c = Source<S>::fetch(src, s);
 
-      uint16_t a = m ? alpha(pen->a, *m++, dest->alpha) : alpha(pen->a, dest->alpha);
+      blend_pixel<D>(c, d, span_alpha<MASK, GALPHA>(c.a, m, ga));
 
-      if (a >= 255) {
-        *d++ = pen->r; *d++ = pen->g; *d++ = pen->b;
-      } else if (a > 0) {
-        *d = blend(pen->r, *d, a); d++;
-        *d = blend(pen->g, *d, a); d++;
-        *d = blend(pen->b, *d, a); d++;
-      }else{
-        d += 3;
-      }       
-
-      s += src->palette ? 1 : 4;
+      d += stride; s += s_step;
+      if (MASK) m++;
     } while (--cnt);
   }
 
-  void P_P(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
-    uint8_t *s = src->data + soff;
+  void blit_span_P(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    const uint8_t *s = src->data + soff;
     uint8_t *d = dest->data + doff;
 
     do {
@@ -146,13 +482,155 @@ namespace blit {
     } while (--cnt);
   }
 
-  void M_M(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
-    uint8_t *s = src->data + soff;
+  template<bool GALPHA>
+  void blit_span_M(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    const uint8_t *s = src->data + soff;
     uint8_t *d = dest->data + doff;
 
+    if (!GALPHA) {
+      if (src_step == 1) {
+        memcpy(d, s, cnt);
+        return;
+      }
+
+      do {
+        *d++ = *s; s += src_step;
+      } while (--cnt);
+      return;
+    }
+
     do {
       *d = blend(*s, *d, dest->alpha); d++;
       s += src_step;
     } while (--cnt);
   }
-}
\ No newline at end of file
+
+
+  // straight copy between surfaces of the same format, only valid when the
+  // source has no transparent pixels and no mask or global alpha applies
+  void copy_span(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    const uint8_t stride = dest->pixel_stride;
+    const uint8_t *s = src->data + soff * stride;
+    uint8_t *d = dest->data + doff * stride;
+
+    if (src_step == 1) {
+      memcpy(d, s, cnt * stride);
+      return;
+    }
+
+    do {
+      memcpy(d, s, stride);
+      d += stride; s += src_step * stride;
+    } while (--cnt);
+  }
+
+  // true if blitting `src` onto `dest` can be done with copy_span()
+  __attribute__((always_inline)) inline bool can_copy(const Surface *src, const Surface *dest) {
+    if (src->format != dest->format || dest->mask || dest->alpha != 255)
+      return false;
+
+    return src->opaque || src->format == PixelFormat::RGB || src->format == PixelFormat::M;
+  }
+
+
+  // kernel selection
+
+  template<PixelFormat D>
+  __attribute__((always_inline)) inline PenBlendFunc select_pen_span(const Surface *dest) {
+    if (dest->mask)
+      return dest->alpha != 255 ? pen_span<D, true, true> : pen_span<D, true, false>;
+
+    return dest->alpha != 255 ? pen_span<D, false, true> : pen_span<D, false, false>;
+  }
+
+  template<PixelFormat S, PixelFormat D>
+  __attribute__((always_inline)) inline BlitBlendFunc select_blit_span(const Surface *dest) {
+    if (dest->mask)
+      return dest->alpha != 255 ? blit_span<S, D, true, true> : blit_span<S, D, true, false>;
+
+    return dest->alpha != 255 ? blit_span<S, D, false, true> : blit_span<S, D, false, false>;
+  }
+
+  template<PixelFormat D>
+  __attribute__((always_inline)) inline BlitBlendFunc select_blit_span(const Surface *src, const Surface *dest) {
+    switch (src->format) {
+    case PixelFormat::P:   return select_blit_span<PixelFormat::P, D>(dest);
+    case PixelFormat::RGB: return select_blit_span<PixelFormat::RGB, D>(dest);
+    default:               return select_blit_span<PixelFormat::RGBA, D>(dest);
+    }
+  }
+
+  /**
+   * Return the pen blend function specialised for the current state of the
+   * destination surface.
+   *
+   * The result is only valid until the mask or global alpha of `dest` changes.
+   *
+   * \param dest
+   */
+  PenBlendFunc get_pen_blend_func(const Surface *dest) {
+    switch (dest->format) {
+    case PixelFormat::RGBA: return select_pen_span<PixelFormat::RGBA>(dest);
+    case PixelFormat::RGB:  return select_pen_span<PixelFormat::RGB>(dest);
+    case PixelFormat::P:    return pen_span_P;
+    default:                return dest->alpha != 255 ? pen_span_M<true> : pen_span_M<false>;
+    }
+  }
+
+  /**
+   * Return the blit blend function specialised for the source pixel format
+   * and the current state of the destination surface.
+   *
+   * The result is only valid until the mask or global alpha of `dest` changes.
+   *
+   * \param src
+   * \param dest
+   */
+  BlitBlendFunc get_blit_blend_func(const Surface *src, const Surface *dest) {
+    if (can_copy(src, dest))
+      return copy_span;
+
+    switch (dest->format) {
+    case PixelFormat::RGBA: return select_blit_span<PixelFormat::RGBA>(src, dest);
+    case PixelFormat::RGB:  return select_blit_span<PixelFormat::RGB>(src, dest);
+    case PixelFormat::P:    return blit_span_P;
+    default:                return dest->alpha != 255 ? blit_span_M<true> : blit_span_M<false>;
+    }
+  }
+
+
+  // generic blend functions bound to `Surface::pbf` and `Surface::bbf`, these
+  // resolve the surface state once per span and jump to the matching kernel
+
+  void RGBA_RGBA(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    select_pen_span<PixelFormat::RGBA>(dest)(pen, dest, off, cnt);
+  }
+
+  void RGBA_RGB(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    select_pen_span<PixelFormat::RGB>(dest)(pen, dest, off, cnt);
+  }
+
+  void P_P(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    pen_span_P(pen, dest, off, cnt);
+  }
+
+  void M_M(const Pen* pen, const Surface* dest, uint32_t off, uint32_t cnt) {
+    (dest->alpha != 255 ? pen_span_M<true> : pen_span_M<false>)(pen, dest, off, cnt);
+  }
+
+  void RGBA_RGBA(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    select_blit_span<PixelFormat::RGBA>(src, dest)(src, soff, dest, doff, cnt, src_step);
+  }
+
+  void RGBA_RGB(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    select_blit_span<PixelFormat::RGB>(src, dest)(src, soff, dest, doff, cnt, src_step);
+  }
+
+  void P_P(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    blit_span_P(src, soff, dest, doff, cnt, src_step);
+  }
+
+  void M_M(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step) {
+    (dest->alpha != 255 ? blit_span_M<true> : blit_span_M<false>)(src, soff, dest, doff, cnt, src_step);
+  }
+}
@@ -25,4 +25,10 @@ namespace blit {
   extern void P_P(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step);
   extern void M_M(const Surface* src, uint32_t soff, const Surface* dest, uint32_t doff, uint32_t cnt, int32_t src_step);
 
+  // return the span kernel specialised for the current mask and global alpha
+  // of the destination (and the format of the source for blits). the result
+  // must be fetched again if the mask or global alpha change
+  extern PenBlendFunc get_pen_blend_func(const Surface* dest);
+  extern BlitBlendFunc get_blit_blend_func(const Surface* src, const Surface* dest);
+
 }
\ No newline at end of file
@@ -0,0 +1,277 @@
+/*! \file compositor.cpp
+    \brief Layered tile maps drawn with occlusion culling.
+*/
+#include <algorithm>
+#include <cmath>
+
+#include "compositor.hpp"
+#include "blend.hpp"
+
+namespace blit {
+
+  // 0 for an invisible pixel, 255 for a solid one, anything else in between
+  static uint8_t sheet_alpha(const Surface *sheet, int32_t x, int32_t y) {
+    int32_t o = x + y * sheet->bounds.w;
+
+    switch (sheet->format) {
+    case PixelFormat::RGBA:
+      return sheet->data[o * 4 + 3];
+
+    case PixelFormat::RGB:
+      return 255;
+
+    case PixelFormat::P: {
+      // index zero is skipped on paletted targets, palette alpha applies
+      // everywhere else, only count pixels that are the same on both
+      uint8_t index = sheet->data[o];
+      uint8_t a = sheet->palette ? sheet->palette[index].a : 255;
+      if (index == 0)
+        return a == 0 ? 0 : 128;
+
+      return a == 0 ? 128 : a;
+    }
+
+    default:
+      return 128;
+    }
+  }
+
+  /**
+   * Classify every tile of a sprite sheet by how much of it is solid.
+   *
+   * \param[in] sheet
+   * \param[in] tile_size Size of a tile in pixels
+   * \param[out] opacity Opacity of each tile, by tile index
+   */
+  void tile_opacity(const Surface *sheet, const Size &tile_size, std::vector<TileOpacity> &opacity) {
+    int32_t cols = sheet->bounds.w / tile_size.w;
+    int32_t rows = sheet->bounds.h / tile_size.h;
+
+    opacity.resize(cols * rows);
+
+    for (int32_t i = 0; i < cols * rows; i++) {
+      int32_t tx = (i % cols) * tile_size.w;
+      int32_t ty = (i / cols) * tile_size.h;
+
+      bool solid = true, empty = true;
+      for (int32_t y = ty; y < ty + tile_size.h && (solid || empty); y++) {
+        for (int32_t x = tx; x < tx + tile_size.w; x++) {
+          uint8_t a = sheet_alpha(sheet, x, y);
+          solid &= a == 255;
+          empty &= a == 0;
+        }
+      }
+
+      opacity[i] = solid ? TileOpacity::opaque : (empty ? TileOpacity::transparent : TileOpacity::mixed);
+    }
+  }
+
+  // calls `f(x, n, toff, opacity)` for each run of `n` pixels from `x` that
+  // fall in the same tile (at `toff` in the map) between `x` and `end` on
+  // scanline `y` of a layer
+  template<typename Map, typename F>
+  __attribute__((always_inline)) inline void for_each_tile_run(Map *map, const std::vector<TileOpacity> &opacity, Point origin, int32_t y, int32_t x, int32_t end, F f) {
+    const auto &ts = map->tile_size;
+
+    int32_t wx = origin.x + x;
+    int32_t ty = (origin.y + y) >> ts.shift_y;
+
+    while (x < end) {
+      int32_t n = std::min(ts.w - (wx & (ts.w - 1)), end - x);
+
+      TileOpacity op = TileOpacity::transparent;
+      int32_t toff = map->offset(wx >> ts.shift_x, ty);
+      if (toff != -1) {
+        uint32_t tile_id = map->tile_at_offset(toff);
+        op = tile_id < opacity.size() ? opacity[tile_id] : TileOpacity::mixed;
+      }
+
+      f(x, n, toff, op);
+
+      x += n;
+      wx += n;
+    }
+  }
+
+  /**
+   * Add a layer in front of the existing ones.
+   *
+   * The map's own `transform` is not used, layers are positioned by
+   * `scroll`, `parallax` and `offset`.
+   *
+   * \param[in] map
+   * \param[in] parallax Rate the layer scrolls at, (1, 1) moves with `scroll`
+   * \param[in] offset Position of the layer when `scroll` is zero
+   * \return Index of the new layer
+   */
+  template<typename Map>
+  uint32_t TileCompositorT<Map>::add_layer(Map *map, Vec2 parallax, Vec2 offset) {
+    layers.push_back({map, parallax, offset, true, {}});
+    update_opacity(layers.size() - 1);
+
+    return layers.size() - 1;
+  }
+
+  /**
+   * Reclassify the tiles of a layer, needed after the layer's sprite sheet
+   * has been changed.
+   *
+   * \param[in] layer Index of the layer
+   */
+  template<typename Map>
+  void TileCompositorT<Map>::update_opacity(uint32_t layer) {
+    Layer &l = layers[layer];
+    Size size(l.map->tile_size.w, l.map->tile_size.h);
+
+    // layers sharing a sheet share its opacity
+    for (auto &other : layers) {
+      if (&other != &l && other.map->sprites == l.map->sprites && other.map->tile_size.w == size.w && other.map->tile_size.h == size.h && !other.opacity.empty()) {
+        l.opacity = other.opacity;
+        return;
+      }
+    }
+
+    tile_opacity(l.map->sprites, size, l.opacity);
+  }
+
+  // removes the opaque runs in `solid` from the gaps left to draw
+  template<typename Map>
+  void TileCompositorT<Map>::hide() {
+    next_gaps.clear();
+
+    uint32_t si = 0;
+    for (auto &gap : gaps) {
+      int32_t x = gap.x;
+
+      for (; si < solid.size() && solid[si].x < gap.end; si++) {
+        if (solid[si].x > x)
+          next_gaps.push_back({x, solid[si].x, 0});
+
+        x = solid[si].end;
+      }
+
+      if (x < gap.end)
+        next_gaps.push_back({x, gap.end, 0});
+    }
+
+    std::swap(gaps, next_gaps);
+  }
+
+  /**
+   * Draw the layers to a specified destination surface, with clipping.
+   *
+   * Pixels hidden by an opaque tile of a layer in front are not drawn,
+   * unless `dest` has global alpha or a mask which would let them show
+   * through.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] viewport Area of `dest` to draw to, the layers scroll relative to its top left corner.
+   */
+  template<typename Map>
+  void TileCompositorT<Map>::draw(Surface *dest, Rect viewport) {
+    stats = {};
+
+    Rect r = dest->clip.intersection(viewport);
+    if (r.empty())
+      return;
+
+    dest->add_damage(r);
+
+    const bool cull = dest->alpha == 255 && !dest->mask;
+    const int32_t count = layers.size();
+
+    origins.resize(count);
+    for (int32_t i = 0; i < count; i++) {
+      Vec2 o = Vec2(scroll.x * layers[i].parallax.x, scroll.y * layers[i].parallax.y) + layers[i].offset;
+      origins[i] = Point(floorf(o.x) + (r.x - viewport.x), floorf(o.y) + (r.y - viewport.y));
+    }
+
+    layer_runs.resize(count + 1);
+
+    for (int32_t y = 0; y < r.h; y++) {
+      gaps.clear();
+      gaps.push_back({0, r.w, 0});
+      runs.clear();
+
+      // walk the layers front to back, finding the tiles to draw in the gaps
+      // left by the opaque tiles of the layers in front
+      for (int32_t i = count - 1; i >= 0; i--) {
+        Layer &l = layers[i];
+        layer_runs[i + 1] = runs.size();
+
+        if (!l.visible)
+          continue;
+
+        int32_t open = 0;
+        solid.clear();
+
+        for (auto &gap : gaps) {
+          open += gap.end - gap.x;
+
+          for_each_tile_run(l.map, l.opacity, origins[i], y, gap.x, gap.end, [&](int32_t x, int32_t n, int32_t toff, TileOpacity op) {
+            if (op == TileOpacity::transparent)
+              return;
+
+            runs.push_back({x, x + n, toff});
+
+            if (cull && op == TileOpacity::opaque) {
+              if (!solid.empty() && solid.back().end == x)
+                solid.back().end = x + n;
+              else
+                solid.push_back({x, x + n, 0});
+            }
+          });
+        }
+
+        stats.culled += r.w - open;
+
+        if (!solid.empty())
+          hide();
+      }
+      layer_runs[0] = runs.size();
+
+      // draw the tiles found back to front
+      const uint32_t doff = dest->offset(r.x, r.y + y);
+
+      for (int32_t i = 0; i < count; i++) {
+        if (layer_runs[i] == layer_runs[i + 1])
+          continue;
+
+        Map *map = layers[i].map;
+        Surface *src = map->sprites;
+        TileSheet<decltype(map->tile_size)> sheet(map->tile_size, src);
+        BlitBlendFunc blend_func = get_blit_blend_func(src, dest);
+
+        const int32_t u0 = origins[i].x;
+        const int32_t v = (origins[i].y + y) & (map->tile_size.h - 1);
+
+        for (uint32_t ti = layer_runs[i + 1]; ti < layer_runs[i]; ti++) {
+          const Run &run = runs[ti];
+          uint8_t transform = map->transform_at_offset(run.tile);
+          Point t = sheet.texel(map->tile_at_offset(run.tile), transform, (u0 + run.x) & (map->tile_size.w - 1), v);
+
+          blend_func(src, src->offset(t), dest, doff + run.x, run.end - run.x, sheet.step(transform));
+          stats.drawn += run.end - run.x;
+        }
+      }
+    }
+  }
+
+  template struct TileCompositorT<TileMapT<8, 8, uint8_t>>;
+  template struct TileCompositorT<TileMapT<8, 8, uint16_t>>;
+  template struct TileCompositorT<TileMapT<16, 16, uint8_t>>;
+  template struct TileCompositorT<TileMapT<16, 16, uint16_t>>;
+  template struct TileCompositorT<TileMapT<32, 32, uint8_t>>;
+  template struct TileCompositorT<TileMapT<32, 32, uint16_t>>;
+  template struct TileCompositorT<TileMapT<0, 0, uint8_t>>;
+  template struct TileCompositorT<TileMapT<0, 0, uint16_t>>;
+  template struct TileCompositorT<StreamingTileMapT<8, 8, uint8_t>>;
+  template struct TileCompositorT<StreamingTileMapT<8, 8, uint16_t>>;
+  template struct TileCompositorT<StreamingTileMapT<16, 16, uint8_t>>;
+  template struct TileCompositorT<StreamingTileMapT<16, 16, uint16_t>>;
+  template struct TileCompositorT<StreamingTileMapT<32, 32, uint8_t>>;
+  template struct TileCompositorT<StreamingTileMapT<32, 32, uint16_t>>;
+  template struct TileCompositorT<StreamingTileMapT<0, 0, uint8_t>>;
+  template struct TileCompositorT<StreamingTileMapT<0, 0, uint16_t>>;
+
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "surface.hpp"
+#include "tilemap.hpp"
+#include "../types/vec2.hpp"
+
+namespace blit {
+
+  // how much of a tile covers whatever is drawn behind it
+  enum class TileOpacity : uint8_t {
+    transparent,  // no visible pixels, the tile is never drawn
+    opaque,       // every pixel is solid, hides the layers behind it
+    mixed         // anything else
+  };
+
+  void tile_opacity(const Surface *sheet, const Size &tile_size, std::vector<TileOpacity> &opacity);
+
+  // Draws a stack of scrolling tile map layers.
+  //
+  // Layers are added back to front. Each scanline is first walked front to
+  // back, looking up each layer's tiles only where no opaque tile of a layer
+  // in front has hidden it, then the tiles found are drawn back to front. A
+  // full opaque foreground costs one layer's worth of lookups and drawing
+  // instead of one per layer. Layers are drawn unscaled, scrolled by
+  // `scroll` times their parallax rate.
+  template<typename Map = TileMap>
+  struct TileCompositorT {
+    struct Layer {
+      Map                      *map;
+      Vec2                      parallax;   // rate the layer scrolls at relative to `scroll`
+      Vec2                      offset;     // position of the layer when `scroll` is zero
+      bool                      visible;
+      std::vector<TileOpacity>  opacity;    // by tile index
+    };
+
+    struct Stats {
+      uint32_t                  drawn;      // pixels drawn across all layers
+      uint32_t                  culled;     // pixels of layers skipped because an opaque tile was in front
+    };
+
+    Vec2                        scroll;
+    std::vector<Layer>          layers;
+
+    Stats                       stats = {};
+
+    uint32_t add_layer(Map *map, Vec2 parallax = Vec2(1, 1), Vec2 offset = Vec2(0, 0));
+    void update_opacity(uint32_t layer);
+
+    void draw(Surface *dest, Rect viewport);
+
+  private:
+    // a run of a scanline, and the tile it falls in for runs of a layer
+    struct Run {
+      int32_t                   x, end;
+      int32_t                   tile;       // offset of the tile in the map
+    };
+
+    std::vector<Run>            gaps, next_gaps; // parts of the scanline not hidden yet
+    std::vector<Run>            runs;
+    std::vector<Run>            solid;      // opaque runs of the layer being walked
+    std::vector<uint32_t>       layer_runs; // the runs of layer `i` are from `layer_runs[i + 1]` up to `layer_runs[i]`
+    std::vector<Point>          origins;    // of each layer relative to the area drawn
+
+    void hide();
+  };
+
+  extern template struct TileCompositorT<TileMapT<8, 8, uint8_t>>;
+  extern template struct TileCompositorT<TileMapT<8, 8, uint16_t>>;
+  extern template struct TileCompositorT<TileMapT<16, 16, uint8_t>>;
+  extern template struct TileCompositorT<TileMapT<16, 16, uint16_t>>;
+  extern template struct TileCompositorT<TileMapT<32, 32, uint8_t>>;
+  extern template struct TileCompositorT<TileMapT<32, 32, uint16_t>>;
+  extern template struct TileCompositorT<TileMapT<0, 0, uint8_t>>;
+  extern template struct TileCompositorT<TileMapT<0, 0, uint16_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<8, 8, uint8_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<8, 8, uint16_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<16, 16, uint8_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<16, 16, uint16_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<32, 32, uint8_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<32, 32, uint16_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<0, 0, uint8_t>>;
+  extern template struct TileCompositorT<StreamingTileMapT<0, 0, uint16_t>>;
+
+  using TileCompositor = TileCompositorT<TileMap>;
+
+}
@@ -0,0 +1,425 @@
+/*! \file drawlist.cpp
+    \brief Recorded drawing commands with tiled replay.
+*/
+#include <algorithm>
+
+#include "drawlist.hpp"
+#include "../engine/api_private.hpp"
+
+namespace blit {
+
+  /**
+   * Start a new command, recording the current drawing state if it changed
+   *
+   * \param type
+   * \param flags
+   * \param ptr
+   * \return the new command for the caller to fill in
+   */
+  DrawList::Command &DrawList::add(CommandType type, uint8_t flags, const void *ptr) {
+    bool changed = states.empty();
+    if (!changed) {
+      const State &s = states.back();
+      changed = s.pen.r != pen.r || s.pen.g != pen.g || s.pen.b != pen.b || s.pen.a != pen.a
+             || s.alpha != alpha || s.mask != mask || s.sprites != sprites;
+    }
+
+    if (changed)
+      states.push_back({pen, alpha, mask, sprites});
+
+    commands.push_back({type, flags, uint32_t(states.size() - 1), ptr, {0}});
+    return commands.back();
+  }
+
+  /**
+   * Record a filled rectangle
+   *
+   * \param r
+   */
+  void DrawList::rectangle(const Rect &r) {
+    Command &c = add(CommandType::RECTANGLE);
+    c.v[0] = r.x; c.v[1] = r.y; c.v[2] = r.w; c.v[3] = r.h;
+  }
+
+  /**
+   * Record a line
+   *
+   * \param p1
+   * \param p2
+   */
+  void DrawList::line(const Point &p1, const Point &p2) {
+    Command &c = add(CommandType::LINE);
+    c.v[0] = p1.x; c.v[1] = p1.y; c.v[2] = p2.x; c.v[3] = p2.y;
+  }
+
+  /**
+   * Record a filled triangle
+   *
+   * \param p1
+   * \param p2
+   * \param p3
+   */
+  void DrawList::triangle(const Point &p1, const Point &p2, const Point &p3) {
+    Command &c = add(CommandType::TRIANGLE);
+    c.v[0] = p1.x; c.v[1] = p1.y; c.v[2] = p2.x; c.v[3] = p2.y; c.v[4] = p3.x; c.v[5] = p3.y;
+  }
+
+  /**
+   * Record a blit from another surface
+   *
+   * \param src
+   * \param r
+   * \param p
+   * \param hflip
+   */
+  void DrawList::blit(Surface *src, const Rect &r, const Point &p, bool hflip) {
+    Command &c = add(CommandType::BLIT, hflip, src);
+    c.v[0] = r.x; c.v[1] = r.y; c.v[2] = r.w; c.v[3] = r.h; c.v[4] = p.x; c.v[5] = p.y;
+  }
+
+  /**
+   * Record a sprite from the current sheet
+   *
+   * \param sprite
+   * \param position
+   * \param transform
+   */
+  void DrawList::sprite(const uint16_t &sprite, const Point &position, const uint8_t &transform) {
+    Rect r = sprites->sprite_bounds(sprite);
+    Command &c = add(CommandType::SPRITE, transform);
+    c.v[0] = r.x; c.v[1] = r.y; c.v[2] = r.w; c.v[3] = r.h; c.v[4] = position.x; c.v[5] = position.y;
+  }
+
+  /**
+   * Record a sprite from the current sheet
+   *
+   * \param sprite
+   * \param position
+   * \param transform
+   */
+  void DrawList::sprite(const Point &sprite, const Point &position, const uint8_t &transform) {
+    DrawList::sprite(Rect(sprite.x, sprite.y, 1, 1), position, transform);
+  }
+
+  /**
+   * Record a sprite from the current sheet
+   *
+   * \param sprite
+   * \param position
+   * \param transform
+   */
+  void DrawList::sprite(const Rect &sprite, const Point &position, const uint8_t &transform) {
+    Rect r = sprites->sprite_bounds(sprite);
+    Command &c = add(CommandType::SPRITE, transform);
+    c.v[0] = r.x; c.v[1] = r.y; c.v[2] = r.w; c.v[3] = r.h; c.v[4] = position.x; c.v[5] = position.y;
+  }
+
+  /**
+   * Record a scaled sprite from the current sheet
+   *
+   * \param sprite
+   * \param position
+   * \param origin
+   * \param scale
+   * \param transform
+   */
+  void DrawList::sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform) {
+    Rect r = sprites->sprite_bounds(sprite);
+    Rect dr(
+      roundf(position.x - float(origin.x * scale.x)),
+      roundf(position.y - float(origin.y * scale.y)),
+      roundf(r.w * scale.x),
+      roundf(r.h * scale.y)
+    );
+
+    Command &c = add(CommandType::STRETCH_SPRITE, transform);
+    c.v[0] = r.x; c.v[1] = r.y; c.v[2] = r.w; c.v[3] = r.h;
+    c.v[4] = dr.x; c.v[5] = dr.y; c.v[6] = dr.w; c.v[7] = dr.h;
+  }
+
+  /**
+   * Record text
+   *
+   * \param message
+   * \param font
+   * \param r
+   * \param variable
+   * \param align
+   * \param clip
+   */
+  void DrawList::text(const std::string &message, const Font &font, const Rect &r, bool variable, TextAlign align, Rect clip) {
+    // resolve the default clip rect the same way Surface::text does
+    if (r.w > 0 && clip.w == 1000)
+      clip = r;
+
+    Command &c = add(CommandType::TEXT);
+    c.v[0] = texts.size();
+    texts.push_back({message, &font, r, clip, variable, align});
+  }
+
+  /**
+   * Record text
+   *
+   * \param message
+   * \param font
+   * \param p
+   * \param variable
+   * \param align
+   * \param clip
+   */
+  void DrawList::text(const std::string &message, const Font &font, const Point &p, bool variable, TextAlign align, Rect clip) {
+    DrawList::text(message, font, Rect(p.x, p.y, 0, 0), variable, align, clip);
+  }
+
+  /**
+   * Area of `dest` a command can draw to (before clipping)
+   *
+   * \param c
+   * \param dest
+   */
+  Rect DrawList::command_bounds(const Command &c, Surface &dest) {
+    const int32_t *v = c.v;
+
+    switch (c.type) {
+    case CommandType::RECTANGLE:
+      return Rect(v[0], v[1], v[2], v[3]);
+
+    case CommandType::LINE:
+      return Rect(
+        Point(std::min(v[0], v[2]), std::min(v[1], v[3])),
+        Point(std::max(v[0], v[2]) + 1, std::max(v[1], v[3]) + 1));
+
+    case CommandType::TRIANGLE:
+      return Rect(
+        Point(std::min(v[0], std::min(v[2], v[4])), std::min(v[1], std::min(v[3], v[5]))),
+        Point(std::max(v[0], std::max(v[2], v[4])) + 1, std::max(v[1], std::max(v[3], v[5])) + 1));
+
+    case CommandType::BLIT:
+    case CommandType::SPRITE:
+      return Rect(v[4], v[5], v[2], v[3]);
+
+    case CommandType::STRETCH_SPRITE:
+      return Rect(v[4], v[5], v[6], v[7]);
+
+    case CommandType::TEXT: {
+      const Text &t = texts[v[0]];
+      Size size = dest.measure_text(t.message, *t.font, t.variable);
+
+      // build the font's glyph runs now rather than from the band threads
+      glyph_runs(*t.font);
+
+      // same alignment as Surface::text, padded for glyphs wider than
+      // their advance and rounding of centred lines
+      Point p(t.r.x, t.r.y);
+      if ((t.align & 0b1100) == TextAlign::right)
+        p.x += t.r.w - size.w;
+      else if ((t.align & 0b1100) != TextAlign::left)
+        p.x += (t.r.w - size.w) / 2;
+
+      if ((t.align & 0b11) == TextAlign::bottom)
+        p.y += t.r.h - size.h;
+      else if ((t.align & 0b11) != TextAlign::top)
+        p.y += (t.r.h - size.h) / 2;
+
+      Rect r(p.x - 1, p.y - 1, size.w + t.font->char_w + 2, size.h + t.font->char_h + 2);
+      return r.intersection(t.clip);
+    }
+    }
+
+    return Rect();
+  }
+
+  /**
+   * Draw a command to `dest`, whose clip rect is already set to `tile`
+   *
+   * \param c
+   * \param dest
+   * \param tile
+   */
+  void DrawList::execute(const Command &c, Surface &dest, const Rect &tile) {
+    const int32_t *v = c.v;
+
+    switch (c.type) {
+    case CommandType::RECTANGLE:
+      dest.rectangle(Rect(v[0], v[1], v[2], v[3]));
+      break;
+
+    case CommandType::LINE:
+      dest.line(Point(v[0], v[1]), Point(v[2], v[3]));
+      break;
+
+    case CommandType::TRIANGLE:
+      dest.triangle(Point(v[0], v[1]), Point(v[2], v[3]), Point(v[4], v[5]));
+      break;
+
+    case CommandType::BLIT:
+      dest.blit((Surface *)c.ptr, Rect(v[0], v[1], v[2], v[3]), Point(v[4], v[5]), c.flags);
+      break;
+
+    case CommandType::SPRITE:
+      dest.blit_sprite(Rect(v[0], v[1], v[2], v[3]), Point(v[4], v[5]), c.flags);
+      break;
+
+    case CommandType::STRETCH_SPRITE:
+      dest.stretch_blit_sprite(Rect(v[0], v[1], v[2], v[3]), Rect(v[4], v[5], v[6], v[7]), c.flags);
+      break;
+
+    case CommandType::TEXT: {
+      // text ignores the surface clip rect so is limited to the tile here
+      const Text &t = texts[v[0]];
+      dest.text(t.message, *t.font, t.r, t.variable, t.align, t.clip.intersection(tile));
+      break;
+    }
+    }
+  }
+
+  struct BandJob {
+    DrawList *list;
+    Surface  *dest;
+  };
+
+  static void run_band_job(void *data, uint32_t band) {
+    BandJob *job = (BandJob *)data;
+    job->list->replay_band(*job->dest, band);
+  }
+
+  /**
+   * Draw all recorded commands to a surface, tile by tile
+   *
+   * Commands are binned by the tiles their bounds touch. Each tile is then
+   * drawn with the surface's clip rect restricted to it, in recording order.
+   * Rows of tiles are independent so if the host provides
+   * `api.parallel_for` they are drawn concurrently.
+   *
+   * The surface's drawing state is left as it was. The list is kept so it
+   * can be replayed again, call `clear()` to start a new frame.
+   *
+   * \param dest
+   */
+  void DrawList::replay(Surface &dest) {
+    const Rect clip = dest.clip;
+    const Rect full(0, 0, dest.bounds.w, dest.bounds.h);
+    const int32_t ts = bin_size = std::max<int32_t>(tile_size, 1);
+
+    cols = (full.w + ts - 1) / ts;
+    rows = (full.h + ts - 1) / ts;
+
+    stats = {};
+    stats.commands = commands.size();
+    stats.area = clip.w * clip.h;
+
+    // clipped bounds of every command, text is clipped by its own rect
+    bounds.resize(commands.size());
+    for (uint32_t i = 0; i < commands.size(); i++) {
+      Rect b = command_bounds(commands[i], dest);
+      bounds[i] = b.intersection(commands[i].type == CommandType::TEXT ? full : clip);
+
+      if (!bounds[i].empty()) {
+        stats.pixels += bounds[i].w * bounds[i].h;
+
+        // bands draw without the tracker so they don't race on it
+        dest.add_damage(bounds[i]);
+      }
+    }
+
+    // count the commands in each tile, then fill the bins in command order
+    bin_start.assign(cols * rows + 1, 0);
+    for (auto &b : bounds) {
+      if (b.empty())
+        continue;
+
+      for (int32_t ty = b.y / ts; ty <= (b.y + b.h - 1) / ts; ty++)
+        for (int32_t tx = b.x / ts; tx <= (b.x + b.w - 1) / ts; tx++)
+          bin_start[ty * cols + tx + 1]++;
+    }
+
+    for (int32_t i = 0; i < cols * rows; i++) {
+      stats.tiles += bin_start[i + 1] != 0;
+      bin_start[i + 1] += bin_start[i];
+    }
+
+    stats.binned = bin_start[cols * rows];
+    bin_commands.resize(stats.binned);
+
+    bin_fill.assign(bin_start.begin(), bin_start.end() - 1);
+    for (uint32_t i = 0; i < bounds.size(); i++) {
+      const Rect &b = bounds[i];
+      if (b.empty())
+        continue;
+
+      for (int32_t ty = b.y / ts; ty <= (b.y + b.h - 1) / ts; ty++)
+        for (int32_t tx = b.x / ts; tx <= (b.x + b.w - 1) / ts; tx++)
+          bin_commands[bin_fill[ty * cols + tx]++] = i;
+    }
+
+    if (!stats.binned)
+      return;
+
+    BandJob job = {this, &dest};
+
+    if (api.parallel_for && rows > 1) {
+      api.parallel_for(rows, run_band_job, &job);
+    } else {
+      for (int32_t band = 0; band < rows; band++)
+        replay_band(dest, band);
+    }
+  }
+
+  /**
+   * Draw one row of tiles after binning
+   *
+   * Draws through a copy of `dest` so each band has its own clip rect and
+   * drawing state.
+   *
+   * \param dest
+   * \param band
+   */
+  void DrawList::replay_band(const Surface &dest, uint32_t band) {
+    const int32_t ts = bin_size;
+    const int32_t ty = band;
+
+    if (bin_start[ty * cols] == bin_start[(ty + 1) * cols])
+      return; // nothing in this band
+
+    Surface target = dest;
+    target.damage = nullptr;
+
+    const Rect full(0, 0, dest.bounds.w, dest.bounds.h);
+    uint32_t state = ~0u; // none applied yet
+
+    for (int32_t tx = 0; tx < cols; tx++) {
+      uint32_t start = bin_start[ty * cols + tx];
+      uint32_t end = bin_start[ty * cols + tx + 1];
+      if (start == end)
+        continue;
+
+      Rect tile = full.intersection(Rect(tx * ts, ty * ts, ts, ts));
+      target.clip = dest.clip.intersection(tile);
+
+      for (uint32_t i = start; i < end; i++) {
+        const Command &c = commands[bin_commands[i]];
+
+        if (c.state != state) {
+          const State &s = states[c.state];
+          target.pen = s.pen;
+          target.alpha = s.alpha;
+          target.mask = s.mask;
+          target.sprites = s.sprites;
+          state = c.state;
+        }
+
+        execute(c, target, tile);
+      }
+    }
+  }
+
+  /**
+   * Remove all recorded commands
+   */
+  void DrawList::clear() {
+    commands.clear();
+    states.clear();
+    texts.clear();
+  }
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "surface.hpp"
+#include "sprite.hpp"
+#include "font.hpp"
+#include "../types/rect.hpp"
+#include "../types/point.hpp"
+
+namespace blit {
+
+  // Records drawing calls instead of rasterising them straight away.
+  //
+  // Set the drawing state (pen, alpha, mask, sprites) and call the drawing
+  // functions as you would on a `Surface`. `replay()` then splits the target
+  // into square tiles and draws every command touching a tile while that part
+  // of the target is still in cache. Each row of tiles is a band that can be
+  // drawn on its own thread.
+  struct DrawList {
+    enum class CommandType : uint8_t {
+      RECTANGLE,
+      LINE,
+      TRIANGLE,
+      BLIT,
+      SPRITE,
+      STRETCH_SPRITE,
+      TEXT
+    };
+
+    // drawing state shared by consecutive commands
+    struct State {
+      Pen           pen;
+      uint8_t       alpha;
+      Surface      *mask;
+      SpriteSheet  *sprites;
+    };
+
+    struct Command {
+      CommandType   type;
+      uint8_t       flags;      // sprite transform or blit hflip
+      uint32_t      state;      // index into `states`
+      const void   *ptr;        // source surface for blits
+      int32_t       v[8];       // coordinates, depends on type
+    };
+
+    struct Text {
+      std::string   message;
+      const Font   *font;
+      Rect          r;
+      Rect          clip;
+      bool          variable;
+      TextAlign     align;
+    };
+
+    struct Stats {
+      uint32_t      commands;   // commands recorded
+      uint32_t      tiles;      // tiles with at least one command
+      uint32_t      binned;     // command draws across all tiles
+      uint32_t      pixels;     // total area covered by command bounds
+      uint32_t      area;       // area of the target clip rect
+    };
+
+    // current drawing state
+    Pen                     pen;
+    uint8_t                 alpha = 255;
+    Surface                *mask = nullptr;
+    SpriteSheet            *sprites = nullptr;
+
+    uint16_t                tile_size = 32;   // side of the square tiles, 0 is treated as 1
+
+    std::vector<Command>    commands;
+    std::vector<State>      states;
+    std::vector<Text>       texts;
+
+    Stats                   stats = {};
+
+    void rectangle(const Rect &r);
+    void line(const Point &p1, const Point &p2);
+    void triangle(const Point &p1, const Point &p2, const Point &p3);
+    void blit(Surface *src, const Rect &r, const Point &p, bool hflip = false);
+
+    void sprite(const uint16_t &sprite, const Point &position, const uint8_t &transform = 0);
+    void sprite(const Point &sprite, const Point &position, const uint8_t &transform = 0);
+    void sprite(const Rect &sprite, const Point &position, const uint8_t &transform = 0);
+    void sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0);
+
+    void text(const std::string &message, const Font &font, const Rect &r, bool variable = true, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
+    void text(const std::string &message, const Font &font, const Point &p, bool variable = true, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
+
+    void replay(Surface &dest);
+    void replay_band(const Surface &dest, uint32_t band);
+    void clear();
+
+  private:
+    int32_t                 cols = 0;
+    int32_t                 rows = 0;
+    int32_t                 bin_size = 0;     // `tile_size` used by the last `replay()`
+
+    std::vector<Rect>       bounds;
+    std::vector<uint32_t>   bin_start;
+    std::vector<uint32_t>   bin_commands;
+    std::vector<uint32_t>   bin_fill;
+
+    Command &add(CommandType type, uint8_t flags = 0, const void *ptr = nullptr);
+    Rect command_bounds(const Command &c, Surface &dest);
+    void execute(const Command &c, Surface &dest, const Rect &tile);
+  };
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
 namespace blit {
   struct Font {
@@ -19,6 +20,25 @@ namespace blit {
     const uint8_t *char_w_variable;
   };
 
+  // one horizontal run of set pixels in a glyph
+  struct GlyphRun {
+    uint8_t x, y, w;
+  };
+
+  // every glyph of a font as runs, built once by `glyph_runs()` so text can
+  // be drawn a span at a time instead of a bit at a time
+  struct GlyphRuns {
+    static const int glyph_count = 96;
+
+    const uint8_t          *data;
+    uint8_t                 char_w, char_h;
+
+    uint16_t                start[glyph_count + 1]; // index of the first run of each glyph
+    std::vector<GlyphRun>   runs;
+  };
+
+  const GlyphRuns &glyph_runs(const Font &font);
+
   extern const Font outline_font;
   extern const Font fat_font;
   extern const Font minimal_font;
@@ -105,9 +105,14 @@ namespace blit {
    * \param[in] viewport
    */
   void mode7(Surface *dest, Surface *sprites, MapLayer *layer, float fov, float angle, Vec2 pos, float near, float far, Rect viewport) {
+    Vec2 swc = screen_to_world(Vec2(viewport.x, viewport.y), fov, angle, pos, near, far, viewport);
+    Vec2 ewc = screen_to_world(Vec2(viewport.x + viewport.w, viewport.y), fov, angle, pos, near, far, viewport);
+
     for (int y = viewport.y; y < viewport.y + viewport.h; y++) {
-      Vec2 swc = screen_to_world(Vec2(viewport.x, y), fov, angle, pos, near, far, viewport);
-      Vec2 ewc = screen_to_world(Vec2(viewport.x + viewport.w, y), fov, angle, pos, near, far, viewport);
+      // the next scanline gives the distance covered down the screen, which
+      // far outgrows the distance across it towards the horizon
+      Vec2 nswc = screen_to_world(Vec2(viewport.x, y + 1), fov, angle, pos, near, far, viewport);
+      Vec2 newc = screen_to_world(Vec2(viewport.x + viewport.w, y + 1), fov, angle, pos, near, far, viewport);
 
       layer->mipmap_texture_span(
         dest,
@@ -115,7 +120,11 @@ namespace blit {
         viewport.w,
         sprites,
         swc,
-        ewc);
+        ewc,
+        ((nswc + newc) - (swc + ewc)) / 2.0f);
+
+      swc = nswc;
+      ewc = newc;
     }
 
     Vec2 s = world_to_screen(Vec2(400, 400), fov, angle, pos, near, far, viewport);
@@ -123,4 +132,64 @@ namespace blit {
     dest->pixel(s);
   }
   
+
+  /**
+   * Draw a mode7 ground plane from a table built by `mode7_scanlines`.
+   *
+   * The table only changes when the camera does, so it can be kept from
+   * frame to frame (or shared with `TileMap::draw`) while it is still.
+   *
+   * \param[in] dest
+   * \param[in] sprites Sprite sheet, with mipmaps from `Surface::generate_mipmaps` to reduce shimmering in the distance.
+   * \param[in] layer
+   * \param[in] scanlines One entry for every scanline of `viewport`.
+   * \param[in] viewport
+   */
+  void mode7(Surface *dest, Surface *sprites, MapLayer *layer, const ScanlineTransform *scanlines, Rect viewport) {
+    for (int y = 0; y < viewport.h; y++) {
+      const ScanlineTransform &line = scanlines[y];
+      const ScanlineTransform &next = scanlines[y + 1 < viewport.h ? y + 1 : y];
+      Vec2 centre = line.step * (viewport.w / 2.0f);
+
+      layer->mipmap_texture_span(
+        dest,
+        Point(viewport.x, viewport.y + y),
+        viewport.w,
+        sprites,
+        line.start,
+        line.start + line.step * float(viewport.w),
+        (next.start - line.start) + (next.step * (viewport.w / 2.0f) - centre));
+    }
+  }
+
+  /**
+   * Fill a scanline table with the mode7 perspective view of a camera,
+   * for drawing with `mode7` or `TileMap::draw`.
+   *
+   * \param[out] table `viewport.h` entries to fill.
+   * \param[in] fov Current camera field-of-view
+   * \param[in] angle Current camera z-angle in mode7 world-space
+   * \param[in] pos Current camera position in mode7 world-space
+   * \param[in] near Distance to nearest visible point
+   * \param[in] far Distance to furthest visible point
+   * \param[in] viewport
+   */
+  void mode7_scanlines(ScanlineTransform *table, float fov, float angle, Vec2 pos, float near, float far, Rect viewport) {
+    Vec2 forward(0, -1);
+    forward *= Mat3::rotation(angle);
+
+    Vec2 left = forward;
+    left *= Mat3::rotation((fov / 2.0f));
+
+    Vec2 right = forward;
+    right *= Mat3::rotation(-(fov / 2.0f));
+
+    for (int y = 0; y < viewport.h; y++) {
+      float distance = ((far - near) / float(y)) + near;
+
+      table[y].start = pos + (left * distance);
+      table[y].step = ((pos + (right * distance)) - table[y].start) / float(viewport.w);
+    }
+  }
+
 }
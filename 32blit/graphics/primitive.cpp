@@ -2,9 +2,11 @@
     \brief Drawing routines for primitive shapes.
 */
 
+#include <algorithm>
 #include <cstdlib>
 #include <cmath>
 
+#include "span.hpp"
 #include "surface.hpp"
 
 namespace blit {
@@ -26,10 +28,20 @@ namespace blit {
     if (cr.empty())
       return;
 
+    add_damage(cr);
+
     uint32_t o = offset(cr);
 
-    for (uint8_t y = cr.y; y < cr.y + cr.h; y++) {
-      pbf(&pen, this, o, cr.w);
+    // full width rows are contiguous so can be filled as a single span
+    if (cr.w == bounds.w) {
+      pbf(&pen, this, o, cr.w * cr.h);
+      return;
+    }
+
+    PenBlendFunc blend_func = get_pen_blend_func(this);
+
+    for (int32_t y = cr.y; y < cr.y + cr.h; y++) {
+      blend_func(&pen, this, o, cr.w);
       o += bounds.w;
     }
   }
@@ -43,6 +55,8 @@ namespace blit {
     if (!clip.contains(p))
       return;
 
+    add_damage(Rect(p.x, p.y, 1, 1));
+
     pbf(&pen, this, offset(p), 1);
   }
 
@@ -65,11 +79,18 @@ namespace blit {
       c -= (p.y + c - bounds.h);
     }
 
-    while (c > 0) {
-      pbf(&pen, this, offset(p), 1);
-      p.y++;
-      c--;
-    }
+    if (c <= 0)
+      return;
+
+    add_damage(Rect(p.x, p.y, 1, c));
+
+    PenBlendFunc blend_func = get_pen_blend_func(this);
+
+    uint32_t o = offset(p);
+    do {
+      blend_func(&pen, this, o, 1);
+      o += bounds.w;
+    } while (--c);
   }
 
   /**
@@ -92,6 +113,7 @@ namespace blit {
     }
 
     if (c > 0) {
+      add_damage(Rect(p.x, p.y, c, 1));
       pbf(&pen, this, offset(p), c);
     }
   }
@@ -133,6 +155,106 @@ namespace blit {
     }
   }
 
+  // ceil(a / b) for b > 0
+  static inline int64_t ceil_div(int64_t a, int64_t b) {
+    return a >= 0 ? (a + b - 1) / b : -(-a / b);
+  }
+
+  // draws the pixels of a Bresenham line from p1 towards p2, leaving out p2
+  // if `last` is false
+  //
+  // pixel i along the major axis is offset on the minor axis by
+  // round(i * minor / major) (halves rounding up). that lets the line be
+  // clipped by solving for the first and last visible i directly rather than
+  // stepping through the hidden part, and lets mostly horizontal lines be
+  // drawn as one span per row
+  static void line_pixels(Surface *dest, const Point &p1, const Point &p2, bool last, PenBlendFunc blend_func) {
+    const Rect &clip = dest->clip;
+    if (clip.empty())
+      return;
+
+    const int32_t cx0 = clip.x, cx1 = clip.x + clip.w - 1;
+    const int32_t cy0 = clip.y, cy1 = clip.y + clip.h - 1;
+
+    int32_t dx = abs(p2.x - p1.x), dy = abs(p2.y - p1.y);
+    int32_t sx = p1.x < p2.x ? 1 : -1, sy = p1.y < p2.y ? 1 : -1;
+
+    const bool x_major = dx >= dy;
+
+    // major and minor axis in terms of x and y
+    const int32_t major = x_major ? dx : dy, minor = x_major ? dy : dx;
+    const int32_t ma0 = x_major ? p1.x : p1.y, mi0 = x_major ? p1.y : p1.x;
+    const int32_t ms = x_major ? sx : sy, ns = x_major ? sy : sx;
+    const int32_t ma_lo = x_major ? cx0 : cy0, ma_hi = x_major ? cx1 : cy1;
+    const int32_t mi_lo = x_major ? cy0 : cx0, mi_hi = x_major ? cy1 : cx1;
+
+    // steps visible on the major axis
+    int64_t i0 = 0, i1 = last ? major : major - 1;
+    if (ms > 0) {
+      i0 = std::max(i0, int64_t(ma_lo) - ma0);
+      i1 = std::min(i1, int64_t(ma_hi) - ma0);
+    } else {
+      i0 = std::max(i0, int64_t(ma0) - ma_hi);
+      i1 = std::min(i1, int64_t(ma0) - ma_lo);
+    }
+
+    // minor offsets that are visible, then the steps that produce them
+    int64_t n_lo, n_hi;
+    if (ns > 0) {
+      n_lo = int64_t(mi_lo) - mi0;
+      n_hi = int64_t(mi_hi) - mi0;
+    } else {
+      n_lo = int64_t(mi0) - mi_hi;
+      n_hi = int64_t(mi0) - mi_lo;
+    }
+
+    n_lo = std::max(n_lo, int64_t(0));
+    if (n_lo > n_hi)
+      return;
+
+    // first step at minor offset n
+    auto first_step = [&](int64_t n) -> int64_t {
+      return n <= 0 ? 0 : ceil_div(int64_t(major) * (2 * n - 1), 2 * int64_t(minor));
+    };
+
+    if (minor == 0) {
+      if (n_lo > 0)
+        return;
+    } else {
+      i0 = std::max(i0, first_step(n_lo));
+      i1 = std::min(i1, first_step(n_hi + 1) - 1);
+    }
+
+    if (i0 > i1)
+      return;
+
+    // minor offset at step i
+    auto offset_at = [&](int64_t i) -> int64_t {
+      return major == 0 ? 0 : (2 * int64_t(minor) * i + major) / (2 * int64_t(major));
+    };
+
+    if (x_major) {
+      // one run per row
+      for (int64_t i = i0; i <= i1;) {
+        int64_t n = offset_at(i);
+        int64_t end = minor == 0 ? i1 : std::min(i1, first_step(n + 1) - 1);
+
+        int32_t x = ma0 + ms * int32_t(ms > 0 ? i : end);
+        int32_t y = mi0 + ns * int32_t(n);
+        blend_func(&dest->pen, dest, dest->offset(x, y), uint32_t(end - i + 1));
+
+        i = end + 1;
+      }
+    } else {
+      // one pixel per row
+      for (int64_t i = i0; i <= i1; i++) {
+        int32_t x = mi0 + ns * int32_t(offset_at(i));
+        int32_t y = ma0 + ms * int32_t(i);
+        blend_func(&dest->pen, dest, dest->offset(x, y), 1);
+      }
+    }
+  }
+
   /**
    * Draw a line in the current pen colour.
    *
@@ -140,27 +262,61 @@ namespace blit {
    * \param[in] p2 `Point` describing the end of the line.
    */
   void Surface::line(const Point &p1, const Point &p2) {
-    int32_t dx = int32_t(abs(p2.x - p1.x));
-    int32_t dy = -int32_t(abs(p2.y - p1.y));
+    add_damage(clip.intersection(Rect(
+      Point(std::min(p1.x, p2.x), std::min(p1.y, p2.y)),
+      Point(std::max(p1.x, p2.x) + 1, std::max(p1.y, p2.y) + 1))));
 
-    int32_t sx = (p1.x < p2.x) ? 1 : -1;
-    int32_t sy = (p1.y < p2.y) ? 1 : -1;
+    line_pixels(this, p1, p2, true, get_pen_blend_func(this));
+  }
 
-    int32_t err = dx + dy;
+  /**
+   * Draw connected lines in the current pen colour.
+   *
+   * Each point shared by two lines is drawn once so joins don't blend
+   * twice with a translucent pen.
+   *
+   * \param[in] points `std::vector<Point>` of points to connect.
+   * \param[in] closed Also connect the last point to the first.
+   */
+  void Surface::polyline(const std::vector<Point> &points, bool closed) {
+    polyline(points.data(), points.size(), closed);
+  }
 
-    Point p(p1);
+  /**
+   * Draw connected lines in the current pen colour.
+   *
+   * \param[in] points Array of points to connect.
+   * \param[in] count Number of points.
+   * \param[in] closed Also connect the last point to the first.
+   */
+  void Surface::polyline(const Point *points, uint32_t count, bool closed) {
+    if (count == 0)
+      return;
 
-    while (true) {
-      if (clip.contains(p)) {
-        pbf(&pen, this, offset(p), 1);
-      }
+    Point tl = points[0], br = points[0];
+    for (uint32_t i = 1; i < count; i++) {
+      tl.x = std::min(tl.x, points[i].x);
+      tl.y = std::min(tl.y, points[i].y);
+      br.x = std::max(br.x, points[i].x);
+      br.y = std::max(br.y, points[i].y);
+    }
+    add_damage(clip.intersection(Rect(tl, Point(br.x + 1, br.y + 1))));
 
-      if ((p.x == p2.x) && (p.y == p2.y)) break;
+    PenBlendFunc blend_func = get_pen_blend_func(this);
 
-      int32_t e2 = err * 2;
-      if (e2 >= dy) { err += dy; p.x += sx; }
-      if (e2 <= dx) { err += dx; p.y += sy; }
+    if (count == 1) {
+      line_pixels(this, points[0], points[0], true, blend_func);
+      return;
     }
+
+    // every line leaves out its end point, which the next one starts with
+    for (uint32_t i = 0; i + 1 < count; i++)
+      line_pixels(this, points[i], points[i + 1], false, blend_func);
+
+    if (closed)
+      line_pixels(this, points[count - 1], points[0], false, blend_func);
+    else
+      line_pixels(this, points[count - 1], points[count - 1], true, blend_func);
   }
 
   /**
@@ -184,27 +340,35 @@ namespace blit {
     return (p1.y == p2.y && p1.x > p2.x) || (p1.y < p2.y);
   }
 
-  /**
-   * Draw a triangle in the current pen colour
-   *
-   * \param[in] p1 First `Point` of triangle.
-   * \param[in] p2 Second `Point` of triangle.
-   * \param[in] p3 This `Point` of triangle.
-   */
-  void Surface::triangle(Point p1, Point p2, Point p3) {
+  // calls `span(x, y, count)` for each run of pixels covered by the triangle
+  // within the clip rect of `dest`, one run per row in most cases
+  //
+  // the bounds are walked in 8x8 blocks, blocks outside any edge are skipped,
+  // fully covered blocks produce whole rows and only partially covered ones
+  // are tested per pixel. covered pixels in a row are contiguous so runs from
+  // neighbouring blocks are joined before being passed on
+  template<typename F>
+  static void triangle_spans(Surface *dest, Point p1, Point p2, Point p3, F span) {
     Rect bounds(
       Point(std::min(p1.x, std::min(p2.x, p3.x)), std::min(p1.y, std::min(p2.y, p3.y))),
       Point(std::max(p1.x, std::max(p2.x, p3.x)), std::max(p1.y, std::max(p2.y, p3.y))));
 
-    // clip extremes to frame buffer size
-    Rect mclip = clip; mclip.w--; mclip.h--;
-    bounds = mclip.intersection(bounds);
+    // skip triangles with no width or height
+    if (bounds.empty()) {
+      return;
+    }
+
+    // clip extremes to frame buffer size, bounds are inclusive from here on
+    bounds = dest->clip.intersection(Rect(bounds.x, bounds.y, bounds.w + 1, bounds.h + 1));
 
     // if triangle completely out of bounds then don't bother!
     if (bounds.empty()) {
       return;
     }
 
+    dest->add_damage(bounds);
+    bounds.w--; bounds.h--;
+
     // fix "winding" of vertices if needed
     int32_t winding = orient2d(p1, p2, p3);
     if (winding < 0) {
@@ -225,152 +389,529 @@ namespace blit {
     int32_t b20 = p1.x - p3.x;
 
     Point tl(bounds.x, bounds.y);
-    int32_t w0row = orient2d(p2, p3, tl) + bias0;
-    int32_t w1row = orient2d(p3, p1, tl) + bias1;
-    int32_t w2row = orient2d(p1, p2, tl) + bias2;
+    int32_t w0tl = orient2d(p2, p3, tl) + bias0;
+    int32_t w1tl = orient2d(p3, p1, tl) + bias1;
+    int32_t w2tl = orient2d(p1, p2, tl) + bias2;
 
-    Point p;
+    const int32_t block = 8;
+    const int32_t x1 = bounds.x + bounds.w, y1 = bounds.y + bounds.h;
 
-    for (p.y = bounds.y; p.y <= bounds.y + bounds.h; p.y++) {
-      int32_t w0 = w0row;
-      int32_t w1 = w1row;
-      int32_t w2 = w2row;
+    // pending run per row of the current band of blocks
+    int32_t span_start[block], span_end[block];
 
-      for (p.x = bounds.x; p.x <= bounds.x + bounds.w; p.x++) {
-        if ((w0 | w1 | w2) >= 0) {
-          pbf(&pen, this, offset(p), 1);
+    for (int32_t by = bounds.y; by <= y1; by += block) {
+      int32_t bh = std::min(block, y1 - by + 1);
+
+      for (int32_t r = 0; r < bh; r++) {
+        span_start[r] = span_end[r] = 0;
+      }
+
+      for (int32_t bx = bounds.x; bx <= x1; bx += block) {
+        int32_t bw = std::min(block, x1 - bx + 1);
+
+        // edge functions at the top left of the block
+        int32_t w0 = w0tl + a12 * (bx - bounds.x) + b12 * (by - bounds.y);
+        int32_t w1 = w1tl + a20 * (bx - bounds.x) + b20 * (by - bounds.y);
+        int32_t w2 = w2tl + a01 * (bx - bounds.x) + b01 * (by - bounds.y);
+
+        // smallest and largest value of each edge function over the block
+        int32_t dx = bw - 1, dy = bh - 1;
+        int32_t min0 = w0 + std::min(0, a12 * dx) + std::min(0, b12 * dy);
+        int32_t min1 = w1 + std::min(0, a20 * dx) + std::min(0, b20 * dy);
+        int32_t min2 = w2 + std::min(0, a01 * dx) + std::min(0, b01 * dy);
+        int32_t max0 = w0 + std::max(0, a12 * dx) + std::max(0, b12 * dy);
+        int32_t max1 = w1 + std::max(0, a20 * dx) + std::max(0, b20 * dy);
+        int32_t max2 = w2 + std::max(0, a01 * dx) + std::max(0, b01 * dy);
+
+        // block entirely outside one of the edges
+        if ((max0 | max1 | max2) < 0) {
+          continue;
         }
 
-        w0 += a12;
-        w1 += a20;
-        w2 += a01;
+        bool covered = (min0 | min1 | min2) >= 0;
+
+        for (int32_t r = 0; r < bh; r++) {
+          int32_t start = bx, end = bx + bw;
+
+          if (!covered) {
+            // find the covered run in this row of the block
+            int32_t e0 = w0 + b12 * r, e1 = w1 + b20 * r, e2 = w2 + b01 * r;
+            start = end = 0;
+
+            for (int32_t x = bx; x < bx + bw; x++) {
+              if ((e0 | e1 | e2) >= 0) {
+                if (start == end) {
+                  start = x;
+                }
+                end = x + 1;
+              }
+
+              e0 += a12;
+              e1 += a20;
+              e2 += a01;
+            }
+
+            if (start == end) {
+              continue;
+            }
+          }
+
+          if (start == span_end[r] && span_start[r] != span_end[r]) {
+            span_end[r] = end;
+          } else {
+            if (span_start[r] != span_end[r]) {
+              span(span_start[r], by + r, span_end[r] - span_start[r]);
+            }
+            span_start[r] = start;
+            span_end[r] = end;
+          }
+        }
       }
 
-      w0row += b12;
-      w1row += b20;
-      w2row += b01;
+      for (int32_t r = 0; r < bh; r++) {
+        if (span_start[r] != span_end[r]) {
+          span(span_start[r], by + r, span_end[r] - span_start[r]);
+        }
+      }
     }
   }
 
+  // a value interpolated linearly across a triangle, in 16.16 fixed point
+  struct TriangleAttribute {
+    Point   origin;
+    int64_t value;  // at origin
+    int64_t dx;     // change per pixel to the right
+    int64_t dy;     // change per pixel down
+
+    TriangleAttribute(const Point &p1, float a1, const Point &p2, float a2, const Point &p3, float a3) : origin(p1) {
+      // gradient of the plane through the three vertices
+      float area = float(orient2d(p1, p2, p3));
+      float d2 = a2 - a1, d3 = a3 - a1;
+
+      value = int64_t(a1 * 65536.0f);
+      dx = int64_t((d2 * (p3.y - p1.y) - d3 * (p2.y - p1.y)) / area * 65536.0f);
+      dy = int64_t((d3 * (p2.x - p1.x) - d2 * (p3.x - p1.x)) / area * 65536.0f);
+    }
+
+    __attribute__((always_inline)) inline int64_t at(int32_t x, int32_t y) const {
+      return value + dx * (x - origin.x) + dy * (y - origin.y);
+    }
+  };
+
+  // the same with floating point, for perspective correct mapping
+  struct TriangleAttributeF {
+    Point   origin;
+    float   value, dx, dy;
+
+    TriangleAttributeF(const Point &p1, float a1, const Point &p2, float a2, const Point &p3, float a3) : origin(p1) {
+      float area = float(orient2d(p1, p2, p3));
+      float d2 = a2 - a1, d3 = a3 - a1;
+
+      value = a1;
+      dx = (d2 * (p3.y - p1.y) - d3 * (p2.y - p1.y)) / area;
+      dy = (d3 * (p2.x - p1.x) - d2 * (p3.x - p1.x)) / area;
+    }
+
+    __attribute__((always_inline)) inline float at(int32_t x, int32_t y) const {
+      return value + dx * (x - origin.x) + dy * (y - origin.y);
+    }
+  };
+
+  // perspective correct texture coordinates are exact every this many pixels
+  // and linear in between
+  static const int32_t perspective_step = 8;
+
+  // maps a texel coordinate outside of [0, size) back inside
+  __attribute__((always_inline)) inline int32_t triangle_texel(int32_t c, int32_t size, bool wrap, bool pow2) {
+    if (wrap) {
+      if (pow2)
+        return c & (size - 1);
+
+      c %= size;
+      return c < 0 ? c + size : c;
+    }
+
+    return std::max(0, std::min(c, size - 1));
+  }
+
   /**
-   * Draw a polygon from a std::vector<point> list of points.
+   * Draw a triangle in the current pen colour
    *
-   * \param[in] points `std::vector<point>` of points describing the polygon.
+   * \param[in] p1 First `Point` of triangle.
+   * \param[in] p2 Second `Point` of triangle.
+   * \param[in] p3 This `Point` of triangle.
+   */
+  void Surface::triangle(Point p1, Point p2, Point p3) {
+    PenBlendFunc blend_func = get_pen_blend_func(this);
+
+    triangle_spans(this, p1, p2, p3, [&](int32_t x, int32_t y, int32_t cnt) {
+      blend_func(&pen, this, offset(x, y), cnt);
+    });
+  }
+
+  /**
+   * Draw a triangle with colours interpolated between its vertices
+   *
+   * The alpha of each colour is interpolated too and combined with the
+   * surface's global alpha and mask as usual.
+   *
+   * \param[in] p1 First `Point` of triangle.
+   * \param[in] c1 Colour at `p1`.
+   * \param[in] p2 Second `Point` of triangle.
+   * \param[in] c2 Colour at `p2`.
+   * \param[in] p3 Third `Point` of triangle.
+   * \param[in] c3 Colour at `p3`.
    */
-  void Surface::polygon(std::vector<Point> points) {
-    static int32_t nodes[64]; // maximum allowed number of nodes per scanline for polygon rendering
+  void Surface::shaded_triangle(Point p1, Pen c1, Point p2, Pen c2, Point p3, Pen c3) {
+    if (orient2d(p1, p2, p3) == 0)
+      return;
 
-    int32_t miny = points[0].y, maxy = points[0].y;
+    const TriangleAttribute r(p1, c1.r, p2, c2.r, p3, c3.r);
+    const TriangleAttribute g(p1, c1.g, p2, c2.g, p3, c3.g);
+    const TriangleAttribute b(p1, c1.b, p2, c2.b, p3, c3.b);
+    const TriangleAttribute a(p1, c1.a, p2, c2.a, p3, c3.a);
 
-    for (uint16_t i = 1; i < points.size(); i++) {
-      miny = std::min(miny, points[i].y);
-      maxy = std::max(maxy, points[i].y);
-    }
+    Pen row_data[span_chunk];
+    Surface row((uint8_t *)row_data, PixelFormat::RGBA, Size(span_chunk, 1));
+    row.opaque = c1.a == 255 && c2.a == 255 && c3.a == 255;
+
+    BlitBlendFunc blend_func = get_blit_blend_func(&row, this);
+
+    // values are rounded to the nearest colour and clamped, the edges of the
+    // triangle can sample slightly outside of the vertex colours
+    auto channel = [](int64_t v) {
+      return uint8_t(std::max(int64_t(0), std::min(int64_t(255), (v + 32768) >> 16)));
+    };
+
+    triangle_spans(this, p1, p2, p3, [&](int32_t x, int32_t y, int32_t cnt) {
+      int64_t vr = r.at(x, y), vg = g.at(x, y), vb = b.at(x, y), va = a.at(x, y);
+      uint32_t dest_offset = offset(x, y);
 
-    // for each scanline within the polygon bounds (clipped to clip rect)
-    Point p;
-
-    for (p.y = std::max(clip.y, miny); p.y <= std::min(clip.y + clip.h, maxy); p.y++) {
-      uint8_t n = 0;
-      for (uint16_t i = 0; i < points.size(); i++) {
-        uint16_t j = (i + 1) % points.size();
-        int32_t sy = points[i].y;
-        int32_t ey = points[j].y;
-        int32_t fy = p.y;
-        if ((sy < fy && ey >= fy) || (ey < fy && sy >= fy)) {
-          int32_t sx = points[i].x;
-          int32_t ex = points[j].x;
-          int32_t px = int32_t(sx + float(fy - sy) / float(ey - sy) * float(ex - sx));
-
-          nodes[n++] = px < clip.x ? clip.x : (px >= clip.x + clip.w ? clip.x + clip.w - 1 : px);// clamp(int32_t(sx + float(fy - sy) / float(ey - sy) * float(ex - sx)), clip.x, clip.x + clip.w);
+      for (int32_t cx = 0; cx < cnt; cx += span_chunk) {
+        const int32_t n = std::min(span_chunk, cnt - cx);
+
+        for (int32_t i = 0; i < n; i++) {
+          row_data[i] = Pen(channel(vr), channel(vg), channel(vb), channel(va));
+          vr += r.dx; vg += g.dx; vb += b.dx; va += a.dx;
         }
+
+        blend_func(&row, 0, this, dest_offset, n, 1);
+        dest_offset += n;
       }
+    });
+  }
 
-      uint16_t i = 0;
-      while (i < n - 1) {
-        if (nodes[i] > nodes[i + 1]) {
-          int32_t s = nodes[i]; nodes[i] = nodes[i + 1]; nodes[i + 1] = s;
-          if (i) i--;
-        }
-        else {
-          i++;
-        }
+  /**
+   * Draw a triangle textured from an area of another surface
+   *
+   * Texture coordinates are in pixels relative to the top left of `sr` and
+   * are interpolated linearly (affine) across the triangle. Coordinates
+   * outside of `sr` repeat it with `SampleMode::WRAP`, other modes extend
+   * its edge pixels.
+   *
+   * \param[in] src Surface to take texels from.
+   * \param[in] sr Area of `src` to use as the texture.
+   * \param[in] p1 First `Point` of triangle.
+   * \param[in] uv1 Texture coordinate at `p1`.
+   * \param[in] p2 Second `Point` of triangle.
+   * \param[in] uv2 Texture coordinate at `p2`.
+   * \param[in] p3 Third `Point` of triangle.
+   * \param[in] uv3 Texture coordinate at `p3`.
+   * \param[in] mode How to sample outside of `sr`.
+   */
+  void Surface::textured_triangle(Surface *src, Rect sr, Point p1, Vec2 uv1, Point p2, Vec2 uv2, Point p3, Vec2 uv3, SampleMode mode) {
+    if (sr.empty() || orient2d(p1, p2, p3) == 0)
+      return;
+
+    const TriangleAttribute u(p1, uv1.x, p2, uv2.x, p3, uv3.x);
+    const TriangleAttribute v(p1, uv1.y, p2, uv2.y, p3, uv3.y);
+
+    const bool wrap = mode == SampleMode::WRAP;
+    const bool pow2 = !(sr.w & (sr.w - 1)) && !(sr.h & (sr.h - 1));
+    const int32_t base = src->offset(sr.x, sr.y);
+    const int32_t src_w = src->bounds.w;
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+    int32_t offsets[span_chunk];
+
+    BlitBlendFunc blend_func = get_blit_blend_func(src, this);
+
+    triangle_spans(this, p1, p2, p3, [&](int32_t x, int32_t y, int32_t cnt) {
+      int64_t tu = u.at(x, y), tv = v.at(x, y);
+      uint32_t dest_offset = offset(x, y);
+
+      for (int32_t cx = 0; cx < cnt; cx += span_chunk) {
+        const int32_t n = std::min(span_chunk, cnt - cx);
+
+        for (int32_t i = 0; i < n; i++, tu += u.dx, tv += v.dx)
+          offsets[i] = base + triangle_texel(tu >> 16, sr.w, wrap, pow2) + triangle_texel(tv >> 16, sr.h, wrap, pow2) * src_w;
+
+        gather_pixels(src->data, offsets, row_data, n, src->pixel_stride);
+        blend_func(&row, 0, this, dest_offset, n, 1);
+        dest_offset += n;
       }
+    });
+  }
+
+  /**
+   * Draw a triangle textured from an area of another surface with
+   * perspective correction
+   *
+   * As the affine version but the z of each texture coordinate is the depth
+   * of the vertex (greater than zero) and texture coordinates are
+   * interpolated correctly in perspective. The division is done every few
+   * pixels with the coordinates stepped linearly in between.
+   *
+   * \param[in] src Surface to take texels from.
+   * \param[in] sr Area of `src` to use as the texture.
+   * \param[in] p1 First `Point` of triangle.
+   * \param[in] uvz1 Texture coordinate and depth at `p1`.
+   * \param[in] p2 Second `Point` of triangle.
+   * \param[in] uvz2 Texture coordinate and depth at `p2`.
+   * \param[in] p3 Third `Point` of triangle.
+   * \param[in] uvz3 Texture coordinate and depth at `p3`.
+   * \param[in] mode How to sample outside of `sr`.
+   */
+  void Surface::textured_triangle(Surface *src, Rect sr, Point p1, Vec3 uvz1, Point p2, Vec3 uvz2, Point p3, Vec3 uvz3, SampleMode mode) {
+    if (sr.empty() || orient2d(p1, p2, p3) == 0 || uvz1.z <= 0.0f || uvz2.z <= 0.0f || uvz3.z <= 0.0f)
+      return;
+
+    // u/z, v/z and 1/z are linear in screen space
+    const TriangleAttributeF uq(p1, uvz1.x / uvz1.z, p2, uvz2.x / uvz2.z, p3, uvz3.x / uvz3.z);
+    const TriangleAttributeF vq(p1, uvz1.y / uvz1.z, p2, uvz2.y / uvz2.z, p3, uvz3.y / uvz3.z);
+    const TriangleAttributeF q(p1, 1.0f / uvz1.z, p2, 1.0f / uvz2.z, p3, 1.0f / uvz3.z);
+
+    const bool wrap = mode == SampleMode::WRAP;
+    const bool pow2 = !(sr.w & (sr.w - 1)) && !(sr.h & (sr.h - 1));
+    const int32_t base = src->offset(sr.x, sr.y);
+    const int32_t src_w = src->bounds.w;
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+    int32_t offsets[span_chunk];
+
+    BlitBlendFunc blend_func = get_blit_blend_func(src, this);
+
+    triangle_spans(this, p1, p2, p3, [&](int32_t x, int32_t y, int32_t cnt) {
+      float fu = uq.at(x, y), fv = vq.at(x, y), fq = q.at(x, y);
+      int64_t tu = int64_t(fu / fq * 65536.0f), tv = int64_t(fv / fq * 65536.0f);
+      uint32_t dest_offset = offset(x, y);
+
+      for (int32_t cx = 0; cx < cnt; cx += span_chunk) {
+        const int32_t n = std::min(span_chunk, cnt - cx);
+
+        for (int32_t i = 0; i < n; i += perspective_step) {
+          const int32_t steps = std::min(perspective_step, n - i);
+
+          // exact coordinates at the end of this run
+          fu += uq.dx * steps; fv += vq.dx * steps; fq += q.dx * steps;
+          const int64_t eu = int64_t(fu / fq * 65536.0f), ev = int64_t(fv / fq * 65536.0f);
+          const int64_t du = (eu - tu) / steps, dv = (ev - tv) / steps;
+
+          for (int32_t j = i; j < i + steps; j++, tu += du, tv += dv)
+            offsets[j] = base + triangle_texel(tu >> 16, sr.w, wrap, pow2) + triangle_texel(tv >> 16, sr.h, wrap, pow2) * src_w;
 
-      for (uint16_t i = 0; i < n; i += 2) {
-        h_span(Point(nodes[i], p.y), nodes[i + 1] - nodes[i] + 1);
+          tu = eu; tv = ev;
+        }
+
+        gather_pixels(src->data, offsets, row_data, n, src->pixel_stride);
+        blend_func(&row, 0, this, dest_offset, n, 1);
+        dest_offset += n;
       }
-    }
+    });
   }
-}
 
-  /*
-  void texture_triangle(int32_t x1, int32_t y1, int32_t u1, int32_t v1, int32_t x2, int32_t y2, int32_t u2, int32_t v2, int32_t x3, int32_t y3, int32_t u3, int32_t v3) {
-    int32_t minx = min<int32_t>(x1, min<int32_t>(x2, x3));
-    int32_t maxx = max<int32_t>(x1, max<int32_t>(x2, x3));
-    int32_t miny = min<int32_t>(y1, min<int32_t>(y2, y3));
-    int32_t maxy = max<int32_t>(y1, max<int32_t>(y2, y3));
+  // one edge of a polygon for the scanline filler, x is stepped exactly as
+  // whole pixels plus a remainder over the edge's height
+  struct PolygonEdge {
+    int32_t y0, y1;       // first and last scanline crossed
+    int32_t x;            // crossing on the current scanline
+    int32_t rem;          // fractional part of x, in 1/dy pixels
+    int32_t step;         // whole pixels added per scanline
+    int32_t rem_step;     // fractional pixels added per scanline
+    int32_t dy;           // height of the edge
+    int8_t  winding;      // 1 for edges going down, -1 for up
+  };
+
+  // polygons with up to this many points keep their edges on the stack
+  static const uint32_t polygon_stack_edges = 16;
+
+  static inline int32_t floor_div(int32_t a, int32_t b) {
+    return a / b - ((a % b != 0) && ((a < 0) != (b < 0)));
+  }
 
-    // if triangle completely out of bounds then don't bother!
-    if (maxx < clip.l || minx >= clip.r || maxy < clip.t || miny >= clip.b) {
+  /**
+   * Draw a polygon from a std::vector<point> list of points.
+   *
+   * \param[in] points `std::vector<point>` of points describing the polygon.
+   * \param[in] rule How overlapping parts of the outline are filled.
+   */
+  void Surface::polygon(const std::vector<Point> &points, FillRule rule) {
+    polygon(points.data(), points.size(), rule);
+  }
+
+  /**
+   * Draw a polygon from an array of points.
+   *
+   * A pixel is filled when its top left corner is inside the outline, points
+   * exactly on the left or right of a span are included. With
+   * `FillRule::EVEN_ODD` areas the outline encloses an even number of times
+   * are left empty, with `FillRule::NON_ZERO` they are filled unless the
+   * outline winds around them in both directions equally.
+   *
+   * Edges are sorted once and kept in an active list while the scanlines
+   * they cross are filled, so the cost grows with the number of edges and
+   * the height rather than their product.
+   *
+   * \param[in] points Array of points describing the polygon.
+   * \param[in] count Number of points.
+   * \param[in] rule How overlapping parts of the outline are filled.
+   */
+  void Surface::polygon(const Point *points, uint32_t count, FillRule rule) {
+    if (count < 3)
       return;
+
+    Point tl = points[0], br = points[0];
+    for (uint32_t i = 1; i < count; i++) {
+      tl.x = std::min(tl.x, points[i].x);
+      tl.y = std::min(tl.y, points[i].y);
+      br.x = std::max(br.x, points[i].x);
+      br.y = std::max(br.y, points[i].y);
     }
+    Rect bounds(tl, Point(br.x + 1, br.y + 1));
 
-    // clip extremes to frame buffer size
-    minx = max<int32_t>(minx, clip.l);
-    maxx = min<int32_t>(maxx, clip.r - 1);
-    miny = max<int32_t>(miny, clip.t);
-    maxy = min<int32_t>(maxy, clip.b - 1);
+    // the top row of the bounds never has any crossings
+    Rect dr = clip.intersection(Rect(bounds.x, bounds.y + 1, bounds.w, bounds.h - 1));
+    if (dr.empty())
+      return;
 
-    // bias ensures no overdraw between neighbouring triangles
-    int8_t bias0 = is_top_left(x2, y2, x3, y3) ? 0 : -1;
-    int8_t bias1 = is_top_left(x3, y3, x1, y1) ? 0 : -1;
-    int8_t bias2 = is_top_left(x1, y1, x2, y2) ? 0 : -1;
-
-    int32_t a01 = y1 - y2;
-    int32_t b01 = x2 - x1;
-    int32_t a12 = y2 - y3;
-    int32_t b12 = x3 - x2;
-    int32_t a20 = y3 - y1;
-    int32_t b20 = x1 - x3;
-
-    int32_t w0row = orient2d(x2, y2, x3, y3, minx, miny) + bias0;
-    int32_t w1row = orient2d(x3, y3, x1, y1, minx, miny) + bias1;
-    int32_t w2row = orient2d(x1, y1, x2, y2, minx, miny) + bias2;
-
-    for (int32_t y = miny; y <= maxy; y++) {
-      int32_t w0 = w0row;
-      int32_t w1 = w1row;
-      int32_t w2 = w2row;
-
-      for (int32_t x = minx; x <= maxx; x++) {
-        if ((w0 | w1 | w2) >= 0) {
-          float d = float((y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3));
-          float v1w = float((y2 - y3) * (x - x3) + (x3 - x2) * (y - y3)) / d;
-          float v2w = float((y3 - y1) * (x - x3) + (x1 - x3) * (y - y3)) / d;
-          float v3w = 1.0f - v1w - v2w;
-
-          int32_t tu = (v1w * float(u1) + v2w * float(u2) + v3w * float(u3));
-          int32_t tv = (v1w * float(v1) + v2w * float(v2) + v3w * float(v3));
-          tu %= 128;
-          tv %= 128;
-
-          rgba *t = &sprites[tu + (tv * 128)];
-
-          blend_func((uint8_t *)t, (uint8_t *)target, x + (y * 160));
+    // the edge table and active list are on the stack unless the polygon
+    // has more points than fit
+    PolygonEdge stack_edges[polygon_stack_edges], stack_active[polygon_stack_edges];
+    std::vector<PolygonEdge> heap_edges;
+    PolygonEdge *edges = stack_edges, *active = stack_active;
+
+    if (count > polygon_stack_edges) {
+      heap_edges.resize(count * 2);
+      edges = heap_edges.data();
+      active = edges + count;
+    }
+
+    uint32_t edge_count = 0, active_count = 0;
+
+    // build the edge table, skipping horizontal edges and any outside of
+    // the clipped scanlines
+    for (uint32_t i = 0; i < count; i++) {
+      Point a = points[i], b = points[(i + 1) % count];
+      if (a.y == b.y)
+        continue;
+
+      int8_t winding = 1;
+      if (a.y > b.y) {
+        std::swap(a, b);
+        winding = -1;
+      }
+
+      // crossed by scanlines a.y < y <= b.y
+      PolygonEdge e;
+      e.y0 = std::max(a.y + 1, dr.y);
+      e.y1 = std::min(b.y, dr.y + dr.h - 1);
+      if (e.y0 > e.y1)
+        continue;
+
+      e.dy = b.y - a.y;
+      e.step = floor_div(b.x - a.x, e.dy);
+      e.rem_step = (b.x - a.x) - e.step * e.dy;
+
+      int64_t num = int64_t(e.y0 - a.y) * (b.x - a.x);
+      int64_t q = num / e.dy;
+      if (num % e.dy != 0 && num < 0)
+        q--;
+      e.x = a.x + int32_t(q);
+      e.rem = int32_t(num - q * e.dy);
+      e.winding = winding;
+
+      edges[edge_count++] = e;
+    }
+
+    if (!edge_count)
+      return;
+
+    std::sort(edges, edges + edge_count, [](const PolygonEdge &a, const PolygonEdge &b) { return a.y0 < b.y0; });
+
+    add_damage(dr);
+
+    PenBlendFunc blend_func = get_pen_blend_func(this);
+    const int32_t cl = dr.x, cr = dr.x + dr.w - 1;
+
+    auto span = [&](int32_t x0, int32_t x1, int32_t y) {
+      x0 = std::max(x0, cl);
+      x1 = std::min(x1, cr);
+      if (x0 <= x1)
+        blend_func(&pen, this, offset(x0, y), x1 - x0 + 1);
+    };
+
+    uint32_t next = 0;
+
+    for (int32_t y = edges[0].y0; y < dr.y + dr.h; y++) {
+      // drop finished edges and add the ones starting here
+      active_count = std::remove_if(active, active + active_count, [y](const PolygonEdge &e) { return e.y1 < y; }) - active;
+
+      while (next < edge_count && edges[next].y0 == y)
+        active[active_count++] = edges[next++];
+
+      if (!active_count) {
+        if (next == edge_count)
+          break;
+
+        y = edges[next].y0 - 1;
+        continue;
+      }
+
+      // crossings move little between scanlines so the list is nearly sorted
+      for (uint32_t i = 1; i < active_count; i++) {
+        PolygonEdge e = active[i];
+        uint32_t j = i;
+        while (j > 0 && active[j - 1].x > e.x) {
+          active[j] = active[j - 1];
+          j--;
         }
+        active[j] = e;
+      }
+
+      if (rule == FillRule::EVEN_ODD) {
+        for (uint32_t i = 0; i + 1 < active_count; i += 2)
+          span(active[i].x, active[i + 1].x, y);
+      } else {
+        int32_t winding = 0, start = 0;
+        for (uint32_t i = 0; i < active_count; i++) {
+          const PolygonEdge &e = active[i];
+          if (winding == 0)
+            start = e.x;
 
-        w0 += a12;
-        w1 += a20;
-        w2 += a01;
+          winding += e.winding;
+
+          if (winding == 0)
+            span(start, e.x, y);
+        }
       }
 
-      w0row += b12;
-      w1row += b20;
-      w2row += b01;
+      // step to the next scanline
+      for (uint32_t i = 0; i < active_count; i++) {
+        PolygonEdge &e = active[i];
+        e.x += e.step;
+        e.rem += e.rem_step;
+        if (e.rem >= e.dy) {
+          e.x++;
+          e.rem -= e.dy;
+        }
+      }
     }
   }
+}
 
+  /*
   //
  // Draw a circle.
   //
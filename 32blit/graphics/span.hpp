@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "surface.hpp"
+#include "../types/point.hpp"
+#include "../types/vec2.hpp"
+
+// Internal helpers for the drawing code that samples a source one pixel at
+// a time, gathering the pixels into a short row and drawing the row with a
+// single blend call. Not part of the public API.
+
+namespace blit {
+
+  // number of pixels gathered per blend call
+  static const int32_t span_chunk = 64;
+
+  // a one row surface in the same format as `src` to gather pixels into,
+  // `data` must hold `span_chunk` pixels of up to 4 bytes
+  inline Surface scratch_row(const Surface *src, uint8_t *data) {
+    Surface row(data, src->format, Size(span_chunk, 1));
+    row.palette = src->palette;
+    row.transparent_index = src->transparent_index;
+    row.opaque = src->opaque;
+    return row;
+  }
+
+  // true if a span can be stepped with `SpanStepper`, spans outside the range
+  // of world coordinates (such as the horizon of a perspective view, which
+  // is infinitely far away) are not drawn
+  __attribute__((always_inline)) inline bool steppable(const Vec2 &swc, const Vec2 &dwc) {
+    const float limit = 1048576.0f;
+    return fabsf(swc.x) < limit && fabsf(swc.y) < limit && fabsf(dwc.x) < 1024.0f && fabsf(dwc.y) < 1024.0f;
+  }
+
+  // steps a world coordinate along a span in 32.32 fixed point, which keeps
+  // the error well under a pixel across the span so every path that draws
+  // a span puts tile boundaries on the same pixels, the integer part is just
+  // the high word on 32-bit targets
+  struct SpanStepper {
+    int64_t       x, y;
+    int64_t       dx, dy;
+
+    SpanStepper(const Vec2 &start, const Vec2 &step) :
+      x(floor(double(start.x) * 4294967296.0)), y(floor(double(start.y) * 4294967296.0)),
+      dx(double(step.x) * 4294967296.0), dy(double(step.y) * 4294967296.0) {}
+
+    __attribute__((always_inline)) inline Point point() const { return Point(int32_t(x >> 32), int32_t(y >> 32)); }
+    __attribute__((always_inline)) inline void next() { x += dx; y += dy; }
+  };
+
+  // copies the pixels at `offsets` (relative to `s`) into a packed row
+  __attribute__((always_inline)) inline void gather_pixels(const uint8_t *s, const int32_t *offsets, uint8_t *d, int32_t cnt, uint8_t stride) {
+    switch (stride) {
+    case 1:
+      for (int32_t i = 0; i < cnt; i++)
+        *d++ = s[offsets[i]];
+      break;
+    case 3:
+      for (int32_t i = 0; i < cnt; i++, d += 3) {
+        const uint8_t *p = s + offsets[i] * 3;
+        d[0] = p[0]; d[1] = p[1]; d[2] = p[2];
+      }
+      break;
+    default:
+      for (int32_t i = 0; i < cnt; i++, d += 4)
+        memcpy(d, s + offsets[i] * 4, 4);
+      break;
+    }
+  }
+
+}
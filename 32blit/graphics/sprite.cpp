@@ -1,6 +1,9 @@
 /*! \file sprite.cpp
     \brief Functions for drawing sprites.
 */
+#include <algorithm>
+#include <cmath>
+
 #include "surface.hpp"
 #include "sprite.hpp"
 
@@ -20,6 +23,20 @@ namespace blit {
     cols = bounds.w / 8;
   }
 
+  /**
+   * Set the size of the sprites in the sheet, 8x8 unless changed.
+   *
+   * Sprite indices, sprite coordinates and the tile maps drawing from the
+   * sheet are all in units of this size.
+   *
+   * \param[in] size Size of one sprite in pixels
+   */
+  void SpriteSheet::set_sprite_size(const Size &size) {
+    sprite_size = size;
+    rows = bounds.h / size.h;
+    cols = bounds.w / size.w;
+  }
+
   SpriteSheet *SpriteSheet::load(const uint8_t *data, uint8_t *buffer) {
     return load((packed_image *)data, buffer);
   }
@@ -39,10 +56,10 @@ namespace blit {
    * and returns a `rect` describing the location and size of the sprite in pixels.
    *
    * \param[in] index Index of the sprite in the sheet
-   * \return `rect` sprite x/y location (always a multiple of 8) and size (always 8x8)
+   * \return `rect` sprite x/y location (a multiple of the sprite size) and size (`sprite_size`)
    */
   Rect SpriteSheet::sprite_bounds(const uint16_t &index) {
-    return Rect((index % cols) * 8, (index / cols) * 8, 8, 8);    
+    return Rect((index % cols) * sprite_size.w, (index / cols) * sprite_size.h, sprite_size.w, sprite_size.h);
   }
 
  /**
@@ -52,10 +69,10 @@ namespace blit {
    * and returns a `rect` describing the location of the sprite in pixels.
    *
    * \param[in] p `point` describing the x/y offset of the sprite in the spritesheet
-   * \return `rect` sprite x/y location (always a multiple of 8) and size (always 8x8)
+   * \return `rect` sprite x/y location (a multiple of the sprite size) and size (`sprite_size`)
    */
   Rect SpriteSheet::sprite_bounds(const Point &p) {
-    return Rect(p.x * 8, p.y * 8, 8, 8);
+    return Rect(p.x * sprite_size.w, p.y * sprite_size.h, sprite_size.w, sprite_size.h);
   }
 
  /**
@@ -65,10 +82,154 @@ namespace blit {
    * and returns a `rect` describing the location and size of the sprite in pixels.
    *
    * \param[in] r `rect` describing the x/y offset and size of the sprite in sprite tiles
-   * \return `rect` sprite x/y location (always a multiple of 8) and size (always 8x8)
+   * \return `rect` sprite x/y location (a multiple of the sprite size) and size (a multiple of the sprite size)
    */
   Rect SpriteSheet::sprite_bounds(const Rect &r) {
-    return r * 8;
+    return Rect(r.x * sprite_size.w, r.y * sprite_size.h, r.w * sprite_size.w, r.h * sprite_size.h);
+  }
+
+
+  /**
+   * Queue a sprite from the batch sheet
+   *
+   * \param[in] sprite Index of the sprite in the sheet
+   * \param[in] position `point` at which to place the sprite in the target surface
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add(const uint16_t &sprite, const Point &position, const uint8_t &transform, const int16_t &layer) {
+    Rect src = sprites->sprite_bounds(sprite);
+    add_pixels(src, Rect(position.x, position.y, src.w, src.h), transform, layer);
+  }
+
+  /**
+   * Queue a sprite from the batch sheet
+   *
+   * \param[in] sprite `point` describing the x/y offset of the sprite in the spritesheet in tiles/units
+   * \param[in] position `point` at which to place the sprite in the target surface
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add(const Point &sprite, const Point &position, const uint8_t &transform, const int16_t &layer) {
+    Rect src = sprites->sprite_bounds(sprite);
+    add_pixels(src, Rect(position.x, position.y, src.w, src.h), transform, layer);
+  }
+
+  /**
+   * Queue a sprite from the batch sheet
+   *
+   * \param[in] sprite `rect` describing the x/y offset and size of the sprite in the spritesheet in tiles/units
+   * \param[in] position `point` at which to place the sprite in the target surface
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add(const Rect &sprite, const Point &position, const uint8_t &transform, const int16_t &layer) {
+    Rect src = sprites->sprite_bounds(sprite);
+    add_pixels(src, Rect(position.x, position.y, src.w, src.h), transform, layer);
+  }
+
+  /**
+   * Queue a scaled sprite from the batch sheet
+   *
+   * \param[in] sprite `rect` describing the x/y offset and size of the sprite in the spritesheet in tiles/units
+   * \param[in] position `point` at which to place the sprite in the target surface
+   * \param[in] origin `point` around which to transform & scale the sprite
+   * \param[in] scale `vec2` x/y scale factor
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform, const int16_t &layer) {
+    Rect src = sprites->sprite_bounds(sprite);
+    Rect dest_rect(
+      roundf(position.x - float(origin.x * scale.x)),
+      roundf(position.y - float(origin.y * scale.y)),
+      roundf(src.w * scale.x),
+      roundf(src.h * scale.y)
+    );
+
+    add_pixels(src, dest_rect, transform, layer);
+  }
+
+  /**
+   * Queue a scaled sprite from the batch sheet
+   *
+   * \param[in] sprite Index of the sprite in the sheet
+   * \param[in] position `point` at which to place the sprite in the target surface
+   * \param[in] origin `point` around which to transform & scale the sprite
+   * \param[in] scale `vec2` x/y scale factor
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform, const int16_t &layer) {
+    Rect src = sprites->sprite_bounds(sprite);
+    Rect dest_rect(
+      roundf(position.x - float(origin.x * scale.x)),
+      roundf(position.y - float(origin.y * scale.y)),
+      roundf(src.w * scale.x),
+      roundf(src.h * scale.y)
+    );
+
+    add_pixels(src, dest_rect, transform, layer);
+  }
+
+  /**
+   * Queue an arbitrary area of the batch sheet
+   *
+   * \param[in] src `rect` in sheet pixels
+   * \param[in] dest `rect` in target pixels, the sprite is stretched if the size differs from `src`
+   * \param[in] transform to apply
+   * \param[in] layer sprites in lower layers are drawn first
+   */
+  void SpriteBatch::add_pixels(const Rect &src, const Rect &dest, const uint8_t &transform, const int16_t &layer) {
+    entries.push_back({sprites, src, dest, transform, layer, uint32_t(entries.size())});
+  }
+
+  /**
+   * Draw all queued sprites to a surface and empty the batch
+   *
+   * \param[in] target surface to draw to
+   */
+  void SpriteBatch::flush(Surface &target) {
+    // drop anything outside the clip rect
+    auto end = std::remove_if(entries.begin(), entries.end(), [&target](const Entry &e) {
+      return target.clip.intersection(e.dest).empty();
+    });
+    entries.erase(end, entries.end());
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+      if (a.layer != b.layer)
+        return a.layer < b.layer;
+      if (a.sheet != b.sheet)
+        return a.sheet < b.sheet;
+      return a.order < b.order;
+    });
+
+    SpriteSheet *old_sprites = target.sprites;
+    SpriteSheet *sheet = nullptr;
+    BlitBlendFunc blend_func = nullptr;
+
+    for (auto &e : entries) {
+      if (e.sheet != sheet) {
+        sheet = e.sheet;
+        target.sprites = sheet;
+        blend_func = get_blit_blend_func(sheet, &target);
+      }
+
+      if (e.dest.w == e.src.w && e.dest.h == e.src.h)
+        target.blit_sprite(e.src, e.dest.tl(), e.transform, blend_func);
+      else
+        target.stretch_blit_sprite(e.src, e.dest, e.transform, blend_func);
+    }
+
+    target.sprites = old_sprites;
+    entries.clear();
+  }
+
+  /**
+   * Discard all queued sprites
+   */
+  void SpriteBatch::clear() {
+    entries.clear();
   }
 
 
@@ -156,6 +317,29 @@ namespace blit {
 
   // scaled sprites with origin
 
+  // transform from sprite pixels to the target surface for rotated sprites,
+  // the flips and x/y swap are applied first as in blit_sprite
+  static Mat3 sprite_matrix(const Size &size, const Point &position, const Point &origin, const Vec2 &scale, float rotation, uint8_t t) {
+    Mat3 m = Mat3::translation(Vec2(position.x, position.y)) * Mat3::rotation(rotation) * Mat3::scale(scale) * Mat3::translation(Vec2(-origin.x, -origin.y));
+
+    // size of the sprite once swapped
+    Size s = (t & SpriteTransform::XYSWAP) ? Size(size.h, size.w) : size;
+
+    if (t & SpriteTransform::HORIZONTAL)
+      m *= Mat3::translation(Vec2(s.w, 0)) * Mat3::scale(Vec2(-1, 1));
+
+    if (t & SpriteTransform::VERTICAL)
+      m *= Mat3::translation(Vec2(0, s.h)) * Mat3::scale(Vec2(1, -1));
+
+    if (t & SpriteTransform::XYSWAP) {
+      Mat3 swap;
+      swap.v01 = 1.0f; swap.v10 = 1.0f; swap.v22 = 1.0f;
+      m *= swap;
+    }
+
+    return m;
+  }
+
   /**
    * Draws a sprite to the surface
    * 
@@ -164,17 +348,25 @@ namespace blit {
    * \param[in] origin `point` around which to transform & scale the sprite
    * \param[in] scale `vec2` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform) {
+  void Surface::sprite(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform, const float &rotation) {
+    Rect src = sprites->sprite_bounds(sprite);
+
+    if (rotation != 0.0f) {
+      transform_blit(sprites, src, sprite_matrix(Size(src.w, src.h), position, origin, scale, rotation, transform));
+      return;
+    }
+
     Rect dest_rect(
       roundf(position.x - float(origin.x * scale.x)),
       roundf(position.y - float(origin.y * scale.y)),
-      roundf(8.0f * scale.x),
-      roundf(8.0f * scale.y)
+      roundf(src.w * scale.x),
+      roundf(src.h * scale.y)
     );
 
     stretch_blit_sprite(
-      sprites->sprite_bounds(sprite),
+      src,
       dest_rect,
       transform);
   }
@@ -187,17 +379,25 @@ namespace blit {
    * \param[in] origin `point` around which to transform & scale the sprite
    * \param[in] scale `vec2` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const Point &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform) {
+  void Surface::sprite(const Point &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform, const float &rotation) {
+    Rect src = sprites->sprite_bounds(sprite);
+
+    if (rotation != 0.0f) {
+      transform_blit(sprites, src, sprite_matrix(Size(src.w, src.h), position, origin, scale, rotation, transform));
+      return;
+    }
+
     Rect dest_rect(
       roundf(position.x - float(origin.x * scale.x)),
       roundf(position.y - float(origin.y * scale.y)),
-      roundf(8.0f * scale.x),
-      roundf(8.0f * scale.y)
+      roundf(src.w * scale.x),
+      roundf(src.h * scale.y)
     );
 
     stretch_blit_sprite(
-      sprites->sprite_bounds(sprite),
+      src,
       dest_rect,
       transform);
   }
@@ -210,17 +410,25 @@ namespace blit {
    * \param[in] origin `point` around which to transform  & scale the sprite
    * \param[in] scale `vec2` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform) {
+  void Surface::sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform, const float &rotation) {
+    Rect src = sprites->sprite_bounds(sprite);
+
+    if (rotation != 0.0f) {
+      transform_blit(sprites, src, sprite_matrix(Size(src.w, src.h), position, origin, scale, rotation, transform));
+      return;
+    }
+
     Rect dest_rect(
       roundf(position.x - float(origin.x * scale.x)),
       roundf(position.y - float(origin.y * scale.y)),
-      roundf(sprite.w * 8.0f * scale.x),
-      roundf(sprite.h * 8.0f * scale.y)
+      roundf(src.w * scale.x),
+      roundf(src.h * scale.y)
     );
 
     stretch_blit_sprite(
-      sprites->sprite_bounds(sprite),
+      src,
       dest_rect,
       transform);
   }
@@ -233,9 +441,10 @@ namespace blit {
    * \param[in] origin `point` around which to transform & scale the sprite
    * \param[in] scale `float` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const uint16_t &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform) {
-    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform);
+  void Surface::sprite(const uint16_t &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform, const float &rotation) {
+    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform, rotation);
   }
 
   /**
@@ -246,9 +455,10 @@ namespace blit {
    * \param[in] origin `point` around which to transform & scale the sprite
    * \param[in] scale `float` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const Point &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform) {
-    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform);
+  void Surface::sprite(const Point &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform, const float &rotation) {
+    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform, rotation);
   }
 
   /**
@@ -259,9 +469,10 @@ namespace blit {
    * \param[in] origin `point` around which to transform  & scale the sprite
    * \param[in] scale `float` x/y scale factor
    * \param[in] transform to apply
+   * \param[in] rotation angle in radians to rotate the sprite around `origin`
    */
-  void Surface::sprite(const Rect &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform) {
-    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform);
+  void Surface::sprite(const Rect &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform, const float &rotation) {
+    Surface::sprite(sprite, position, origin, Vec2(scale, scale), transform, rotation);
   }
 
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <vector>
+
 #include "surface.hpp"
 
 namespace blit {
@@ -25,9 +27,12 @@ namespace blit {
 
   struct SpriteSheet : Surface {
     uint16_t  rows, cols;
+    Size      sprite_size = Size(8, 8);   // size of one sprite (or tile) in pixels
 
     SpriteSheet(uint8_t *data, PixelFormat format, const packed_image *image);
 
+    void set_sprite_size(const Size &size);
+
     static SpriteSheet *load(const uint8_t *data, uint8_t *buffer = nullptr);
     static SpriteSheet *load(const packed_image *image, uint8_t *buffer = nullptr);
 
@@ -36,4 +41,39 @@ namespace blit {
     Rect sprite_bounds(const Rect &r);
   };
 
+  // Collects sprite draws during render() and submits them together.
+  //
+  // On flush() sprites outside the target's clip rect are dropped and the
+  // rest are drawn in layer order (lowest first). Within a layer sprites are
+  // grouped by sheet, sprites from the same sheet keep their submission
+  // order. The blend function is selected once per sheet so the target's
+  // alpha and mask should not change between adding sprites and flushing.
+  struct SpriteBatch {
+    struct Entry {
+      SpriteSheet  *sheet;
+      Rect          src;        // sprite rect in sheet pixels
+      Rect          dest;       // destination rect, scaled if size differs from src
+      uint8_t       transform;
+      int16_t       layer;
+      uint32_t      order;      // submission order, keeps the sort stable
+    };
+
+    SpriteSheet          *sprites;    // sheet used by add(), can be changed between calls
+    std::vector<Entry>    entries;
+
+    SpriteBatch(SpriteSheet *sprites) : sprites(sprites) {}
+
+    void add(const uint16_t &sprite, const Point &position, const uint8_t &transform = 0, const int16_t &layer = 0);
+    void add(const Point &sprite, const Point &position, const uint8_t &transform = 0, const int16_t &layer = 0);
+    void add(const Rect &sprite, const Point &position, const uint8_t &transform = 0, const int16_t &layer = 0);
+
+    void add(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0, const int16_t &layer = 0);
+    void add(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0, const int16_t &layer = 0);
+
+    void add_pixels(const Rect &src, const Rect &dest, const uint8_t &transform = 0, const int16_t &layer = 0);
+
+    void flush(Surface &target);
+    void clear();
+  };
+
 } 
\ No newline at end of file
@@ -1,9 +1,12 @@
 /*! \file surface.cpp
 */
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <string>
 
 #include "font.hpp"
+#include "span.hpp"
 #include "sprite.hpp"
 #include "surface.hpp"
 
@@ -21,6 +24,51 @@ namespace blit {
     init();
   }
 
+  /**
+   * Add a damaged area
+   *
+   * The area is merged into an existing rect it overlaps or touches. Once the
+   * list is full it is merged into the rect that grows the least.
+   *
+   * \param r
+   */
+  void DamageTracker::add(const Rect &r) {
+    if (all || r.empty())
+      return;
+
+    auto merged = [&r](const Rect &d) {
+      return Rect(
+        Point(std::min(d.x, r.x), std::min(d.y, r.y)),
+        Point(std::max(d.x + d.w, r.x + r.w), std::max(d.y + d.h, r.y + r.h)));
+    };
+
+    for (uint8_t i = 0; i < count; i++) {
+      Rect &d = rects[i];
+      if (r.x <= d.x + d.w && d.x <= r.x + r.w && r.y <= d.y + d.h && d.y <= r.y + r.h) {
+        d = merged(d);
+        return;
+      }
+    }
+
+    if (count < max_rects) {
+      rects[count++] = r;
+      return;
+    }
+
+    uint8_t best = 0;
+    int32_t best_growth = INT32_MAX;
+    for (uint8_t i = 0; i < count; i++) {
+      Rect m = merged(rects[i]);
+      int32_t growth = m.w * m.h - rects[i].w * rects[i].h;
+      if (growth < best_growth) {
+        best = i;
+        best_growth = growth;
+      }
+    }
+
+    rects[best] = merged(rects[best]);
+  }
+
   Surface *Surface::load(const packed_image *image) {
     uint8_t *buffer = new uint8_t[pixel_format_stride[image->format] * image->width * image->height];
     return new Surface(buffer, (PixelFormat)image->format, image);
@@ -52,60 +100,229 @@ namespace blit {
     }
   }
 
+  // averages a 2x2 block of straight alpha pixels, colours are weighted by
+  // alpha so transparent pixels don't darken the edges of sprites
+  __attribute__((always_inline)) inline void box_filter(const Pen &c1, const Pen &c2, const Pen &c3, const Pen &c4, uint8_t *d) {
+    const uint32_t a = c1.a + c2.a + c3.a + c4.a;
+
+    if (a == 255 * 4) {
+      d[0] = (c1.r + c2.r + c3.r + c4.r + 2) >> 2;
+      d[1] = (c1.g + c2.g + c3.g + c4.g + 2) >> 2;
+      d[2] = (c1.b + c2.b + c3.b + c4.b + 2) >> 2;
+      d[3] = 255;
+    } else if (a == 0) {
+      d[0] = d[1] = d[2] = d[3] = 0;
+    } else {
+      d[0] = (c1.r * c1.a + c2.r * c2.a + c3.r * c3.a + c4.r * c4.a + a / 2) / a;
+      d[1] = (c1.g * c1.a + c2.g * c2.a + c3.g * c3.a + c4.g * c4.a + a / 2) / a;
+      d[2] = (c1.b * c1.a + c2.b * c2.a + c3.b * c3.a + c4.b * c4.a + a / 2) / a;
+      d[3] = (a + 2) >> 2;
+    }
+  }
+
+  // halves a row pair of a format without alpha, every channel is averaged
+  // on its own so the loop is left simple enough for the compiler to vectorise
+  template<uint8_t S>
+  static void downsample_row(const uint8_t *s0, const uint8_t *s1, uint8_t *d, int32_t w) {
+    for (int32_t x = 0; x < w; x++, s0 += S * 2, s1 += S * 2, d += S) {
+      for (uint8_t c = 0; c < S; c++)
+        d[c] = (s0[c] + s0[c + S] + s1[c] + s1[c + S] + 2) >> 2;
+    }
+  }
+
+  static void downsample_row_rgba(const Pen *s0, const Pen *s1, uint8_t *d, int32_t w) {
+    for (int32_t x = 0; x < w; x++, s0 += 2, s1 += 2, d += 4)
+      box_filter(s0[0], s0[1], s1[0], s1[1], d);
+  }
+
+  static void downsample_row_p(const Surface *src, const uint8_t *s0, const uint8_t *s1, uint8_t *d, int32_t w) {
+    const Pen *palette = src->palette;
+    for (int32_t x = 0; x < w; x++, s0 += 2, s1 += 2, d += 4)
+      box_filter(palette[s0[0]], palette[s0[1]], palette[s1[0]], palette[s1[1]], d);
+  }
+
   /**
    * Generate mipmaps for surface
    *
-   * \param depth `uint8_t`
+   * Each level is half the size of the one before, every pixel the average
+   * of a 2x2 block. Levels have the same format as the surface except for
+   * paletted surfaces, whose levels are RGBA. The levels are stored one
+   * after another following the pixel data of the surface, which must have
+   * room for them (a third of the surface size is enough for RGB, RGBA and
+   * M, four thirds for paletted).
+   *
+   * Calling this again replaces the existing levels.
+   *
+   * \param depth Number of levels to generate, stops early once a side would be less than one pixel
    */
   void Surface::generate_mipmaps(uint8_t depth) {
-    uint16_t w = bounds.w;
-    uint16_t h = bounds.h;
+    for (size_t i = 1; i < mipmaps.size(); i++)
+      delete mipmaps[i];
 
+    mipmaps.clear();
     mipmaps.reserve(depth + 1);
-    
-    Surface *src = this;
-    mipmaps.push_back(src);
-    
+    mipmaps.push_back(this);
+
+    const PixelFormat mipmap_format = format == PixelFormat::P ? PixelFormat::RGBA : format;
+
     // offset the data pointer to the end
     uint8_t *mipmap_data = data + (row_stride * bounds.h);
 
-    do {
-      w /= 2;
-      h /= 2;      
-      Surface *dest = new Surface(mipmap_data, PixelFormat::RGBA, Size(w, h));
+    Surface *src = this;
+    for (; depth && src->bounds.w > 1 && src->bounds.h > 1; depth--) {
+      Surface *dest = new Surface(mipmap_data, mipmap_format, Size(src->bounds.w / 2, src->bounds.h / 2));
+      dest->opaque = opaque;
       mipmaps.push_back(dest);
-      
-      for (int y = 0; y < h; y++) {      
-        for (int x = 0; x < w; x++) {
-          // sample the average ARGB values
-          Pen *c1, *c2, *c3, *c4;
-          if (src->format == PixelFormat::P) {
-            c1 = &src->palette[*src->ptr(Point(x * 2, y * 2))];
-            c2 = &src->palette[*src->ptr(Point(x * 2 + 1, y * 2))];
-            c3 = &src->palette[*src->ptr(Point(x * 2 + 1, y * 2 + 1))];
-            c4 = &src->palette[*src->ptr(Point(x * 2, y * 2 + 1))];
-          }
-          else {
-            c1 = (Pen *)(src->ptr(Point(x * 2, y * 2)));
-            c2 = (Pen *)(src->ptr(Point(x * 2 + 1, y * 2)));
-            c3 = (Pen *)(src->ptr(Point(x * 2 + 1, y * 2 + 1)));
-            c4 = (Pen *)(src->ptr(Point(x * 2, y * 2 + 1)));
-          }
-
-          uint8_t a = (c1->a + c2->a + c3->a + c4->a) / 4;
-          uint8_t r = (c1->r + c2->r + c3->r + c4->r) / 4;
-          uint8_t g = (c1->g + c2->g + c3->g + c4->g) / 4;
-          uint8_t b = (c1->b + c2->b + c3->b + c4->b) / 4;          
-          a = 255;
 
-          dest->pen = Pen(r, g, b, a);
-          dest->pixel(Point(x, y));
+      for (int32_t y = 0; y < dest->bounds.h; y++) {
+        const uint8_t *s0 = src->data + (y * 2) * src->row_stride;
+        const uint8_t *s1 = s0 + src->row_stride;
+        uint8_t *d = dest->data + y * dest->row_stride;
+
+        switch (src->format) {
+        case PixelFormat::RGBA:
+          downsample_row_rgba((const Pen *)s0, (const Pen *)s1, d, dest->bounds.w);
+          break;
+        case PixelFormat::RGB:
+          downsample_row<3>(s0, s1, d, dest->bounds.w);
+          break;
+        case PixelFormat::P:
+          downsample_row_p(src, s0, s1, d, dest->bounds.w);
+          break;
+        case PixelFormat::M:
+          downsample_row<1>(s0, s1, d, dest->bounds.w);
+          break;
         }
       }
 
-      src = dest;    
+      src = dest;
       mipmap_data += (src->row_stride * src->bounds.h);
-    } while (--depth);
+    }
+  }
+
+  // the colours of the texels at `offsets` in `src`, negative offsets give
+  // a transparent pen
+  static void gather_pens(const Surface *src, const int32_t *offsets, Pen *d, int32_t cnt) {
+    const uint8_t *s = src->data;
+
+    switch (src->format) {
+    case PixelFormat::RGBA:
+      for (int32_t i = 0; i < cnt; i++)
+        d[i] = offsets[i] < 0 ? Pen(0, 0, 0, 0) : ((const Pen *)s)[offsets[i]];
+      break;
+    case PixelFormat::RGB:
+      for (int32_t i = 0; i < cnt; i++) {
+        const uint8_t *p = s + std::max(0, offsets[i]) * 3;
+        d[i] = offsets[i] < 0 ? Pen(0, 0, 0, 0) : Pen(p[0], p[1], p[2]);
+      }
+      break;
+    case PixelFormat::P:
+      for (int32_t i = 0; i < cnt; i++)
+        d[i] = offsets[i] < 0 ? Pen(0, 0, 0, 0) : src->palette[s[offsets[i]]];
+      break;
+    case PixelFormat::M:
+      for (int32_t i = 0; i < cnt; i++)
+        d[i] = offsets[i] < 0 ? Pen(0, 0, 0, 0) : Pen(s[offsets[i]], s[offsets[i]], s[offsets[i]]);
+      break;
+    }
+  }
+
+  // blends `s` into `d` by `f` / 256, weighting colours by alpha where the
+  // alpha differs
+  static void lerp_pens(Pen *d, const Pen *s, uint32_t f, int32_t cnt) {
+    for (int32_t i = 0; i < cnt; i++, d++, s++) {
+      if (d->a == s->a) {
+        d->r += (int32_t(f) * (s->r - d->r)) >> 8;
+        d->g += (int32_t(f) * (s->g - d->g)) >> 8;
+        d->b += (int32_t(f) * (s->b - d->b)) >> 8;
+        continue;
+      }
+
+      const uint32_t wd = d->a * (256 - f), ws = s->a * f, w = wd + ws;
+      d->r = (d->r * wd + s->r * ws + w / 2) / w;
+      d->g = (d->g * wd + s->g * ws + w / 2) / w;
+      d->b = (d->b * wd + s->b * ws + w / 2) / w;
+      d->a = (w + 128) >> 8;
+    }
+  }
+
+  /**
+   * Level of detail to sample a texture at
+   *
+   * \param dx Change in texture coordinates between neighbouring pixels of a span
+   * \param dy Change in texture coordinates between neighbouring spans
+   * \return Base two logarithm of the texels covered by a pixel, zero or less when magnified
+   */
+  float mipmap_lod(const Vec2 &dx, const Vec2 &dy) {
+    const float d = std::max(dx.x * dx.x + dx.y * dx.y, dy.x * dy.x + dy.y * dy.y);
+    return d > 0.0f ? 0.5f * log2f(d) : 0.0f;
+  }
+
+  /**
+   * Draw a horizontal span of texels from `src` and its mipmaps
+   *
+   * Each pixel takes the nearest texel from the two levels either side of
+   * `lod` and blends between them (trilinear filtering with nearest texels),
+   * so the detail fades smoothly as a texture recedes instead of shimmering.
+   * `uv` is in the coordinates of `src` itself and is scaled for each level.
+   *
+   * \param src Surface with mipmaps from `generate_mipmaps`, drawn without filtering if there are none
+   * \param p Position of the first pixel of the span
+   * \param cnt Number of pixels in the span
+   * \param uv Texel coordinates for each pixel, a negative x leaves the pixel untouched
+   * \param lod Level of detail, usually from `mipmap_lod`
+   */
+  void Surface::mipmap_span(Surface *src, Point p, int32_t cnt, const Point *uv, float lod) {
+    if (p.y < clip.y || p.y >= clip.y + clip.h)
+      return;
+
+    const int32_t skip = std::max(0, clip.x - p.x);
+    cnt = std::min(cnt, clip.x + clip.w - p.x) - skip;
+    if (cnt <= 0)
+      return;
+
+    p.x += skip;
+    uv += skip;
+
+    // the level below and above `lod` and the weight of the upper one
+    const int32_t levels = std::max(1, int32_t(src->mipmaps.size()));
+    int32_t level = 0;
+    uint32_t f = 0;
+    if (lod > 0.0f) {
+      level = std::min(int32_t(lod), levels - 1);
+      f = level == levels - 1 ? 0 : uint32_t((lod - level) * 256.0f);
+    }
+
+    const Surface *l0 = src->mipmaps.empty() ? src : src->mipmaps[level];
+    const Surface *l1 = f ? src->mipmaps[level + 1] : nullptr;
+
+    Pen row0[span_chunk], row1[span_chunk];
+    int32_t o0[span_chunk], o1[span_chunk];
+
+    Surface row((uint8_t *)row0, PixelFormat::RGBA, Size(span_chunk, 1));
+    BlitBlendFunc blend_func = get_blit_blend_func(&row, this);
+
+    add_damage(Rect(p.x, p.y, cnt, 1));
+
+    uint32_t dest_offset = offset(p);
+    for (int32_t cx = 0; cx < cnt; cx += span_chunk) {
+      const int32_t n = std::min(span_chunk, cnt - cx);
+      const Point *t = uv + cx;
+
+      for (int32_t i = 0; i < n; i++)
+        o0[i] = t[i].x < 0 ? -1 : (t[i].x >> level) + (t[i].y >> level) * l0->bounds.w;
+      gather_pens(l0, o0, row0, n);
+
+      if (l1) {
+        for (int32_t i = 0; i < n; i++)
+          o1[i] = t[i].x < 0 ? -1 : (t[i].x >> (level + 1)) + (t[i].y >> (level + 1)) * l1->bounds.w;
+        gather_pens(l1, o1, row1, n);
+        lerp_pens(row0, row1, f, n);
+      }
+
+      blend_func(&row, 0, this, dest_offset, n, 1);
+      dest_offset += n;
+    }
   }
 
   /**
@@ -116,54 +333,284 @@ namespace blit {
    * \param t
    */
   void Surface::blit_sprite(const Rect &sprite, const Point &p, const uint8_t &t) {
+    blit_sprite(sprite, p, t, get_blit_blend_func(sprites, this));
+  }
+
+  /**
+   * Blit a sprite to the surface using an already selected blend function
+   *
+   * \param sprite
+   * \param p
+   * \param t
+   * \param blend_func result of `get_blit_blend_func(sprites, this)`
+   */
+  void Surface::blit_sprite(const Rect &sprite, const Point &p, const uint8_t &t, BlitBlendFunc blend_func) {
     Rect dr = clip.intersection(Rect(p.x, p.y, sprite.w, sprite.h));  // clipped destination rect
 
     if (dr.empty())
       return; // after clipping there is nothing to draw
 
-    uint8_t left = dr.x - p.x;
-    uint8_t top = dr.y - p.y;
-    uint8_t right = sprite.w - (sprite.w - dr.w) + left - 1;
-    uint8_t bottom = sprite.h - (sprite.h - dr.h) + top - 1;    
-    
+    add_damage(dr);
+
+    int32_t left = dr.x - p.x;
+    int32_t top = dr.y - p.y;
+    int32_t x_step = 1;
+    int32_t y_step = 1;
+
     if (t & SpriteTransform::VERTICAL) {
-      top    = sprite.h - 1 - top;
-      bottom = sprite.h - 1 - bottom;
+      top = sprite.h - 1 - top;
+      y_step = -1;
     }
 
     if (t & SpriteTransform::HORIZONTAL) {
-      left  = sprite.w - 1 - left;
-      right = sprite.w - 1 - right;
+      left = sprite.w - 1 - left;
+      x_step = -1;
     }
 
-    int y_step = top < bottom ? 1 : -1;
-    int x_step = left < right ? 1 : -1;
+    // resolve the transform into a starting offset in the sprite sheet and
+    // the distance to move through it per destination pixel and row
+    int32_t src_offset, src_x_step, src_y_step;
+    if (t & SpriteTransform::XYSWAP) {
+      src_offset = sprites->offset(sprite.x + top, sprite.y + left);
+      src_x_step = x_step * sprites->bounds.w;
+      src_y_step = y_step;
+    } else {
+      src_offset = sprites->offset(sprite.x + left, sprite.y + top);
+      src_x_step = x_step;
+      src_y_step = y_step * sprites->bounds.w;
+    }
 
     uint32_t dest_offset = offset(dr);
-    uint32_t src_offset;    
-    
-    uint8_t y_count = dr.h;
-    uint8_t y = top;
-    do {    
-      uint8_t x_count = dr.w;
-      uint8_t x = left;
-      do {      
-        if (t & SpriteTransform::XYSWAP)
-          src_offset = sprites->offset(sprite.x + y, sprite.y + x);
-        else
-          src_offset = sprites->offset(sprite.x + x, sprite.y + y);
-
-        bbf(sprites, src_offset, this, dest_offset, 1, 1);
-        dest_offset++;
-
-        x += x_step;
-      } while (--x_count);
-
-      dest_offset += bounds.w - dr.w;
-      y += y_step;
+
+    int32_t y_count = dr.h;
+    do {
+      blend_func(sprites, src_offset, this, dest_offset, dr.w, src_x_step);
+
+      src_offset += src_y_step;
+      dest_offset += bounds.w;
     } while (--y_count);
   }
 
+  // source pixels and weights for one bilinear filtered pixel, `fx` and `fy`
+  // are the 8 bit fractional position between the 00 and 11 neighbours
+  struct BilinearTap {
+    int32_t o00, o01, o10, o11;
+    uint8_t fx, fy;
+  };
+
+  // filters RGB and M pixels, all channels are interpolated
+  template<uint8_t C>
+  static void filter_pixels(const uint8_t *s, const BilinearTap *t, uint8_t *d, int32_t cnt) {
+    for (; cnt; cnt--, t++, d += C) {
+      const uint32_t w01 = t->fx * (256 - t->fy);
+      const uint32_t w10 = (256 - t->fx) * t->fy;
+      const uint32_t w11 = t->fx * t->fy;
+      const uint32_t w00 = 65536 - w01 - w10 - w11;
+
+      const uint8_t *p00 = s + t->o00 * C, *p01 = s + t->o01 * C;
+      const uint8_t *p10 = s + t->o10 * C, *p11 = s + t->o11 * C;
+
+      for (uint8_t c = 0; c < C; c++)
+        d[c] = (p00[c] * w00 + p01[c] * w01 + p10[c] * w10 + p11[c] * w11 + 32768) >> 16;
+    }
+  }
+
+  // filters RGBA pixels, colours are weighted by alpha so transparent
+  // neighbours don't bleed their (meaningless) colour into the result
+  static void filter_pixels_rgba(const uint8_t *s, const BilinearTap *t, uint8_t *d, int32_t cnt) {
+    for (; cnt; cnt--, t++, d += 4) {
+      const uint32_t w01 = t->fx * (256 - t->fy);
+      const uint32_t w10 = (256 - t->fx) * t->fy;
+      const uint32_t w11 = t->fx * t->fy;
+      const uint32_t w00 = 65536 - w01 - w10 - w11;
+
+      const uint8_t *p00 = s + t->o00 * 4, *p01 = s + t->o01 * 4;
+      const uint8_t *p10 = s + t->o10 * 4, *p11 = s + t->o11 * 4;
+
+      const uint32_t a00 = w00 * p00[3], a01 = w01 * p01[3];
+      const uint32_t a10 = w10 * p10[3], a11 = w11 * p11[3];
+      const uint32_t a = a00 + a01 + a10 + a11;
+
+      if (a == 255u << 16) {
+        for (uint8_t c = 0; c < 3; c++)
+          d[c] = (p00[c] * w00 + p01[c] * w01 + p10[c] * w10 + p11[c] * w11 + 32768) >> 16;
+        d[3] = 255;
+      } else if (a == 0) {
+        d[0] = d[1] = d[2] = d[3] = 0;
+      } else {
+        for (uint8_t c = 0; c < 3; c++)
+          d[c] = (p00[c] * a00 + p01[c] * a01 + p10[c] * a10 + p11[c] * a11 + a / 2) / a;
+        d[3] = (a + 32768) >> 16;
+      }
+    }
+  }
+
+  static void filter_pixels(const Surface *src, const BilinearTap *t, uint8_t *d, int32_t cnt) {
+    switch (src->format) {
+    case PixelFormat::RGBA:
+      filter_pixels_rgba(src->data, t, d, cnt);
+      break;
+    case PixelFormat::RGB:
+      filter_pixels<3>(src->data, t, d, cnt);
+      break;
+    default:
+      filter_pixels<1>(src->data, t, d, cnt);
+      break;
+    }
+  }
+
+  // true if `dest` filters when scaling from `src`, paletted sources can't be
+  // interpolated and always use the nearest pixel
+  static bool use_bilinear(const Surface *src, const Surface *dest) {
+    return dest->filter == SampleFilter::BILINEAR && src->format != PixelFormat::P;
+  }
+
+  // the two source pixel offsets and weight for a 16.16 position along one
+  // axis of a bilinear stretch, clamped to the edges of the source rect
+  static void bilinear_axis(int64_t pos, int32_t size, bool flip, int32_t unit, int32_t &o0, int32_t &o1, uint8_t &f) {
+    int32_t s0 = pos >> 16;
+    int32_t s1 = s0 + 1;
+    f = (pos >> 8) & 0xff;
+
+    s0 = std::max(0, std::min(s0, size - 1));
+    s1 = std::max(0, std::min(s1, size - 1));
+
+    if (flip) {
+      s0 = size - 1 - s0;
+      s1 = size - 1 - s1;
+    }
+
+    o0 = s0 * unit;
+    o1 = s1 * unit;
+  }
+
+  // bilinear filtered version of stretch_rows(), sampling at pixel centres
+  static void stretch_rows_bilinear(const Surface *src, const Rect &sr, Surface *dest, const Rect &dr, const Rect &cdr, uint8_t t, BlitBlendFunc blend_func) {
+    const bool swap = t & SpriteTransform::XYSWAP;
+    const int32_t x_unit = swap ? src->bounds.w : 1;
+    const int32_t y_unit = swap ? 1 : src->bounds.w;
+
+    const int32_t base = sr.x + sr.y * src->bounds.w;
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+
+    int32_t x0[span_chunk], x1[span_chunk];
+    uint8_t fx[span_chunk];
+    BilinearTap taps[span_chunk];
+
+    for (int32_t cx = 0; cx < cdr.w; cx += span_chunk) {
+      const int32_t cnt = std::min(span_chunk, cdr.w - cx);
+
+      for (int32_t i = 0; i < cnt; i++) {
+        int64_t u = (int64_t(2 * (cdr.x - dr.x + cx + i) + 1) * sr.w << 16) / (2 * dr.w) - 32768;
+        bilinear_axis(u, sr.w, t & SpriteTransform::HORIZONTAL, x_unit, x0[i], x1[i], fx[i]);
+      }
+
+      uint32_t dest_offset = dest->offset(cdr.x + cx, cdr.y);
+
+      for (int32_t y = 0; y < cdr.h; y++) {
+        int64_t v = (int64_t(2 * (cdr.y - dr.y + y) + 1) * sr.h << 16) / (2 * dr.h) - 32768;
+
+        int32_t y0, y1;
+        uint8_t fy;
+        bilinear_axis(v, sr.h, t & SpriteTransform::VERTICAL, y_unit, y0, y1, fy);
+        y0 += base;
+        y1 += base;
+
+        for (int32_t i = 0; i < cnt; i++)
+          taps[i] = {y0 + x0[i], y0 + x1[i], y1 + x0[i], y1 + x1[i], fx[i], fy};
+
+        filter_pixels(src, taps, row_data, cnt);
+        blend_func(&row, 0, dest, dest_offset, cnt, 1);
+
+        dest_offset += dest->bounds.w;
+      }
+    }
+  }
+
+  /**
+   * Fixed point (16.16) stretch engine shared by the scaled blits
+   *
+   * Maps the clipped destination rect `cdr` (part of `dr`) back onto the
+   * source rect `sr`, applying the sprite transform `t`. The source offset of
+   * every destination column is worked out once per call; each row then
+   * gathers its pixels into a scratch row and blends them with a single span
+   * call.
+   *
+   * If the destination filter is `SampleFilter::BILINEAR` the scaled pixels
+   * are interpolated instead.
+   *
+   * \param src
+   * \param sr source rect
+   * \param dest
+   * \param dr unclipped destination rect
+   * \param cdr clipped destination rect
+   * \param t `SpriteTransform` bits
+   * \param blend_func result of `get_blit_blend_func(src, dest)`
+   */
+  static void stretch_rows(const Surface *src, const Rect &sr, Surface *dest, const Rect &dr, const Rect &cdr, uint8_t t, BlitBlendFunc blend_func) {
+    if (use_bilinear(src, dest) && (sr.w != dr.w || sr.h != dr.h)) {
+      stretch_rows_bilinear(src, sr, dest, dr, cdr, t, blend_func);
+      return;
+    }
+
+    // steps are rounded up so positions that land exactly on a source pixel
+    // are not truncated to the one before it, the start is exact
+    const int32_t du = ((sr.w << 16) + dr.w - 1) / dr.w;
+    const int32_t dv = ((sr.h << 16) + dr.h - 1) / dr.h;
+
+    // source offset per unit of x/y, swapped for XYSWAP
+    const bool swap = t & SpriteTransform::XYSWAP;
+    const int32_t x_unit = swap ? src->bounds.w : 1;
+    const int32_t y_unit = swap ? 1 : src->bounds.w;
+
+    const int32_t base = sr.x + sr.y * src->bounds.w;
+    const uint8_t stride = src->pixel_stride;
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+
+    int32_t x_offsets[span_chunk];
+
+    for (int32_t cx = 0; cx < cdr.w; cx += span_chunk) {
+      const int32_t cnt = std::min(span_chunk, cdr.w - cx);
+
+      // horizontal source offsets for this group of columns
+      int32_t u = (int64_t(cdr.x - dr.x + cx) * sr.w << 16) / dr.w;
+      for (int32_t i = 0; i < cnt; i++, u += du) {
+        int32_t x = std::min(u >> 16, sr.w - 1);
+        if (t & SpriteTransform::HORIZONTAL)
+          x = sr.w - 1 - x;
+        x_offsets[i] = x * x_unit;
+      }
+
+      // unscaled columns are a straight run in the source, no gather needed
+      const bool direct = du == 1 << 16;
+      const int32_t direct_step = (t & SpriteTransform::HORIZONTAL) ? -x_unit : x_unit;
+
+      uint32_t dest_offset = dest->offset(cdr.x + cx, cdr.y);
+
+      int32_t v = (int64_t(cdr.y - dr.y) * sr.h << 16) / dr.h;
+      for (int32_t y = 0; y < cdr.h; y++, v += dv) {
+        int32_t sy = std::min(v >> 16, sr.h - 1);
+        if (t & SpriteTransform::VERTICAL)
+          sy = sr.h - 1 - sy;
+
+        const int32_t src_offset = base + sy * y_unit;
+
+        if (direct) {
+          blend_func(src, src_offset + x_offsets[0], dest, dest_offset, cnt, direct_step);
+        } else {
+          gather_pixels(src->data + src_offset * stride, x_offsets, row_data, cnt, stride);
+          blend_func(&row, 0, dest, dest_offset, cnt, 1);
+        }
+
+        dest_offset += dest->bounds.w;
+      }
+    }
+  }
+
   /**
    * Blit a stretched sprite to the surface
    *
@@ -172,55 +619,26 @@ namespace blit {
    * \param t
    */
   void Surface::stretch_blit_sprite(const Rect &sprite, const Rect &r, const uint8_t &t) {
+    stretch_blit_sprite(sprite, r, t, get_blit_blend_func(sprites, this));
+  }
+
+  /**
+   * Blit a stretched sprite to the surface using an already selected blend function
+   *
+   * \param sprite
+   * \param r
+   * \param t
+   * \param blend_func result of `get_blit_blend_func(sprites, this)`
+   */
+  void Surface::stretch_blit_sprite(const Rect &sprite, const Rect &r, const uint8_t &t, BlitBlendFunc blend_func) {
     Rect dr = clip.intersection(r);  // clipped destination rect
 
     if (dr.empty())
       return; // after clipping there is nothing to draw
 
-    float scale_x = float(sprite.w) / r.w;
-    float scale_y = float(sprite.h) / r.h;
-
-    float left = (dr.x - r.x) * scale_x;
-    float top = (dr.y - r.y) * scale_y;
-    float right = sprite.w - (sprite.w - (dr.w * scale_x)) + left - 1;
-    float bottom = sprite.h - (sprite.h - (dr.h * scale_y)) + top - 1;
+    add_damage(dr);
 
-    if (t & SpriteTransform::VERTICAL) {
-      top = sprite.h - 1 - top;
-      bottom = sprite.h - 1 - bottom;
-    }
-
-    if (t & SpriteTransform::HORIZONTAL) {
-      left = sprite.w - 1 - left;
-      right = sprite.w - 1 - right;
-    }
-
-    float y_step = top < bottom ? scale_y : -scale_y;
-    float x_step = left < right ? scale_x : -scale_x;
-    
-    uint32_t dest_offset = offset(dr);
-    uint32_t src_offset;
-
-    uint8_t y_count = dr.h;    
-    float y = top;
-    do {
-      uint8_t x_count = dr.w;
-      float x = left;
-      do {
-        if (t & SpriteTransform::XYSWAP)
-          src_offset = sprites->offset(sprite.x + y, sprite.y + x);
-        else
-          src_offset = sprites->offset(sprite.x + x, sprite.y + y);
-
-        bbf(sprites, src_offset, this, dest_offset, 1, 1);
-        dest_offset++;
-
-        x += x_step;
-      } while (--x_count);
-
-      dest_offset += bounds.w - dr.w;
-      y += y_step;
-    } while (--y_count);
+    stretch_rows(sprites, sprite, this, r, dr, t, blend_func);
   }
 
   /**
@@ -238,26 +656,38 @@ namespace blit {
       return; // after clipping there is nothing to draw
 
     // offset source rect to accomodate for clipped destination rect    
-    uint8_t l = dr.x - p.x; // top left corner
-    uint8_t t = dr.y - p.y; 
+    int32_t l = dr.x - p.x; // top left corner
+    int32_t t = dr.y - p.y; 
+
+    // when flipped the left edge of the destination comes from the right
+    // edge of the source, so clipping does not change which pixels land where
+    int32_t src_offset_flip = 0;
+    int8_t src_direction = 1;
+    if (hflip) {
+      src_offset_flip = r.w - 1 - l - l;
+      src_direction = -1;
+    }
+
     r.x += l; r.w -= l; r.y += t; r.h -= t;    
     r.w = dr.w; // clamp width/height
     r.h = dr.h;
 
     uint32_t src_offset = src->offset(r.x, r.y);
 
-    uint8_t src_offset_flip = 0;
-    int8_t src_direction = 1;
-    if (hflip) {
-      src_offset_flip = r.w - 1;
-      src_direction = -1;
-    }
+    BlitBlendFunc blend_func = get_blit_blend_func(src, this);
+
+    add_damage(dr);
 
-    
-    
     int32_t dest_offset = offset(dr);
+
+    // rows that span both surfaces completely are contiguous in memory
+    if (!hflip && r.w == bounds.w && r.w == src->bounds.w) {
+      blend_func(src, src_offset, this, dest_offset, r.w * r.h, 1);
+      return;
+    }
+
     for (int32_t y = p.y; y < p.y + r.h; y++) {
-      bbf(src, src_offset + src_offset_flip, this, dest_offset, r.w, src_direction);
+      blend_func(src, src_offset + src_offset_flip, this, dest_offset, r.w, src_direction);
 
       src_offset += src->bounds.w;
       dest_offset += bounds.w;      
@@ -277,29 +707,9 @@ namespace blit {
     if (cdr.empty())
       return; // after clipping there is nothing to draw
 
-    float sx = (sr.w) / float(dr.w);
-    float sy = (sr.h) / float(dr.h);
+    add_damage(cdr);
 
-    // offset source rect to accomodate for clipped destination rect    
-    uint8_t l = cdr.x - dr.x; // top left corner
-    uint8_t t = cdr.y - dr.y;
-
-    sr.x += (sx * l);
-    sr.y += (sy * t);
-
-    sr.w = cdr.w * sx;
-    sr.h = cdr.h * sy;
-
-    float src_y = sr.y;
-    for (int32_t y = cdr.y; y < cdr.y + cdr.h; y++) {
-      float src_x = sr.x;
-      for (int32_t x = cdr.x; x < cdr.x + cdr.w; x++) {
-        bbf(src, src->offset(src_x, src_y), this, offset(x, y), 1, 1);
-
-        src_x += sx;
-      }      
-      src_y += sy;
-    }
+    stretch_rows(src, sr, this, dr, cdr, 0, get_blit_blend_func(src, this));
   }
 
   /**
@@ -312,12 +722,17 @@ namespace blit {
    * \param dc
    */
   void Surface::stretch_blit_vspan(Surface *src, Point uv, uint16_t sc, Point p, int16_t dc) {
-    float v = uv.y;
-    float vs = float(sc) / float(dc);
+    if (dc <= 0) {
+      return;
+    }
+
+    // 16.16 fixed point source position and step
+    int32_t v = uv.y << 16;
+    int32_t vs = (int32_t(sc) << 16) / dc;
 
     if (p.y < 0) {
       dc += p.y;
-      v += (vs * float(-p.y));
+      v += vs * -p.y;
       p.y = 0;
     }
 
@@ -325,14 +740,172 @@ namespace blit {
       return;
     }
 
-    int16_t max_y = std::min(p.y + dc, bounds.h);
-    for (; p.y < max_y; p.y++) {
-      bbf(src, src->offset(Point(uv.x, v)), this, offset(p), 1, 1);
+    BlitBlendFunc blend_func = get_blit_blend_func(src, this);
+
+    int32_t max_y = std::min(p.y + dc, int32_t(bounds.h));
+    add_damage(Rect(p.x, p.y, 1, max_y - p.y));
+    uint32_t dest_offset = offset(p);
+    for (int32_t y = p.y; y < max_y; y++) {
+      blend_func(src, src->offset(uv.x, v >> 16), this, dest_offset, 1, 1);
 
+      dest_offset += bounds.w;
       v += vs;
     }
   }
 
+  // floor division for the scanline clipping in transform_blit
+  static int64_t floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+  }
+
+  // maps a source coordinate outside of [0, size) back inside for transform_blit
+  static int32_t sample_coord(int64_t c, int32_t size, SampleMode mode, bool pow2) {
+    if (mode == SampleMode::WRAP) {
+      if (pow2)
+        return c & (size - 1);
+
+      c %= size;
+      return c < 0 ? c + size : c;
+    }
+
+    return std::max(int64_t(0), std::min(c, int64_t(size - 1)));
+  }
+
+  // narrows [i0, i1) to the steps where `p + i * dp` lies in [0, lim)
+  static void clip_steps(int64_t p, int64_t dp, int64_t lim, int32_t &i0, int32_t &i1) {
+    int64_t lo, hi;
+    if (dp == 0) {
+      if (p >= 0 && p < lim)
+        return;
+      lo = hi = 0;
+    } else if (dp > 0) {
+      lo = -floor_div(p, dp);
+      hi = -floor_div(p - lim, dp);
+    } else {
+      lo = floor_div(p - lim, -dp) + 1;
+      hi = floor_div(p, -dp) + 1;
+    }
+
+    i0 = std::max(int64_t(i0), lo);
+    i1 = std::min(int64_t(i1), hi);
+  }
+
+  /**
+   * Blit an area of another surface through an affine transform
+   *
+   * `m` maps positions in the source rect (with 0, 0 at its top left corner)
+   * to positions on this surface. With `SampleMode::CLIP` only the area the
+   * source rect lands on is drawn, `WRAP` and `CLAMP` fill the whole clip rect
+   * by repeating the source rect or extending its edge pixels.
+   *
+   * \param src
+   * \param sr source rect
+   * \param m source to destination transform
+   * \param mode how to sample outside of the source rect
+   */
+  void Surface::transform_blit(Surface *src, Rect sr, const Mat3 &m, SampleMode mode) {
+    if (sr.empty() || m.v00 * m.v11 - m.v01 * m.v10 == 0.0f)
+      return; // nothing to draw or the transform collapses the source
+
+    Rect dr = clip;
+    if (mode == SampleMode::CLIP) {
+      // bounding box of the transformed source rect
+      Vec2 corners[4] = {Vec2(0, 0), Vec2(sr.w, 0), Vec2(0, sr.h), Vec2(sr.w, sr.h)};
+      Vec2 tl(INFINITY, INFINITY), br(-INFINITY, -INFINITY);
+      for (auto &c : corners) {
+        c.transform(m);
+        tl.x = std::min(tl.x, c.x); tl.y = std::min(tl.y, c.y);
+        br.x = std::max(br.x, c.x); br.y = std::max(br.y, c.y);
+      }
+
+      dr = clip.intersection(Rect(Point(floorf(tl.x), floorf(tl.y)), Point(ceilf(br.x), ceilf(br.y))));
+    }
+
+    if (dr.empty())
+      return; // after clipping there is nothing to draw
+
+    add_damage(dr);
+
+    Mat3 inv(m);
+    inv.inverse();
+
+    // source position step per destination pixel in 16.16
+    const int64_t du = int64_t(inv.v00 * 65536.0f);
+    const int64_t dv = int64_t(inv.v10 * 65536.0f);
+    const int64_t w_fp = int64_t(sr.w) << 16;
+    const int64_t h_fp = int64_t(sr.h) << 16;
+
+    const bool pow2 = !(sr.w & (sr.w - 1)) && !(sr.h & (sr.h - 1));
+
+    const bool bilinear = use_bilinear(src, this);
+
+    const uint8_t stride = src->pixel_stride;
+    const int32_t base = src->offset(sr.x, sr.y);
+    const int32_t src_w = src->bounds.w;
+
+    BlitBlendFunc blend_func = get_blit_blend_func(src, this);
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+
+    int32_t offsets[span_chunk];
+    BilinearTap taps[span_chunk];
+
+    for (int32_t y = dr.y; y < dr.y + dr.h; y++) {
+      // sample at pixel centres
+      Vec2 start(dr.x + 0.5f, y + 0.5f);
+      start.transform(inv);
+
+      int64_t u = int64_t(floorf(start.x * 65536.0f));
+      int64_t v = int64_t(floorf(start.y * 65536.0f));
+
+      int32_t x0 = 0, x1 = dr.w;
+      if (mode == SampleMode::CLIP) {
+        // only the part of the row that falls inside the source
+        clip_steps(u, du, w_fp, x0, x1);
+        clip_steps(v, dv, h_fp, x0, x1);
+
+        if (x0 >= x1)
+          continue;
+
+        u += du * x0;
+        v += dv * x0;
+      }
+
+      uint32_t dest_offset = offset(dr.x + x0, y);
+
+      for (int32_t cx = x0; cx < x1; cx += span_chunk) {
+        const int32_t cnt = std::min(span_chunk, x1 - cx);
+
+        if (bilinear) {
+          for (int32_t i = 0; i < cnt; i++, u += du, v += dv) {
+            // filter between the four pixel centres around the sample
+            const int64_t bu = u - 32768, bv = v - 32768;
+
+            const int32_t sx0 = sample_coord(bu >> 16, sr.w, mode, pow2);
+            const int32_t sx1 = sample_coord((bu >> 16) + 1, sr.w, mode, pow2);
+            const int32_t sy0 = base + sample_coord(bv >> 16, sr.h, mode, pow2) * src_w;
+            const int32_t sy1 = base + sample_coord((bv >> 16) + 1, sr.h, mode, pow2) * src_w;
+
+            taps[i] = {sy0 + sx0, sy0 + sx1, sy1 + sx0, sy1 + sx1, uint8_t(bu >> 8), uint8_t(bv >> 8)};
+          }
+
+          filter_pixels(src, taps, row_data, cnt);
+        } else {
+          for (int32_t i = 0; i < cnt; i++, u += du, v += dv)
+            offsets[i] = sample_coord(u >> 16, sr.w, mode, pow2) + sample_coord(v >> 16, sr.h, mode, pow2) * src_w;
+
+          gather_pixels(src->data + base * stride, offsets, row_data, cnt, stride);
+        }
+
+        blend_func(&row, 0, this, dest_offset, cnt, 1);
+
+        dest_offset += cnt;
+      }
+    }
+  }
+
   /**
    * TODO: Document this function
    *
@@ -347,6 +920,8 @@ namespace blit {
     if (dr.empty())
       return; // after clipping there is nothing to draw 
 
+    add_damage(dr);
+
     // offset source rect to accomodate for clipped destination rect    
     uint8_t l = dr.x - p.x; // top left corner
     uint8_t t = dr.y - p.y;
@@ -377,6 +952,8 @@ namespace blit {
     if (dr.empty())
       return; // after clipping there is nothing to draw
 
+    add_damage(dr);
+
     uint8_t *p = ptr(dr.x, dr.y);
 
     for (int32_t y = 0; y < dr.h; y++) {
@@ -474,6 +1051,8 @@ namespace blit {
     static Pen pens[] = { Pen(39, 39, 56), Pen(255, 255, 255), Pen(0, 255, 0) };
 
     uint8_t scale = bounds.w / 160;
+    add_damage(Rect(bounds.w - (15 * scale), bounds.h - (15 * scale), 13 * scale, 13 * scale));
+
     for (uint8_t y = 0; y < 13; y++) {
       for (uint8_t x = 0; x < 13; x++) {
         Pen &p = pens[logo[x + y * 13]];
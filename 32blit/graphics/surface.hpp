@@ -1,6 +1,7 @@
 #pragma once
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 #include <array>
 #include <cstdint>
@@ -12,12 +13,14 @@
 #include "font.hpp"
 #include "../types/rect.hpp"
 #include "../types/size.hpp"
+#include "../types/vec3.hpp"
 #include "../graphics/blend.hpp"
 
 namespace blit {
 
   struct SpriteSheet;
   struct sprite_p;
+  struct TextLayout;
 
 #pragma pack(push, 1)
   struct packed_image {
@@ -81,6 +84,43 @@ namespace blit {
   };
 #pragma pack(pop)
 
+  // how transform_blit samples positions outside of the source rect
+  enum class SampleMode {
+    CLIP,   // nothing is drawn there
+    WRAP,   // the source rect repeats
+    CLAMP   // the edge pixels of the source rect are extended
+  };
+
+  // which parts of a self-intersecting polygon are filled
+  enum class FillRule {
+    EVEN_ODD,   // areas enclosed an odd number of times
+    NON_ZERO    // areas the outline winds around at least once more one way than the other
+  };
+
+  // Records the areas of a surface changed by its drawing operations so that
+  // presenting it can skip everything else. Attach one to a surface with
+  // `Surface::damage`. Writes that bypass the drawing functions (direct use
+  // of `data`, `pbf` or `bbf`) are not seen and should call `add()` or
+  // `add_all()` themselves.
+  struct DamageTracker {
+    static const uint8_t max_rects = 8;
+
+    Rect      rects[max_rects];     // damaged areas, may overlap
+    uint8_t   count = 0;
+    bool      all = true;           // the whole surface needs presenting
+
+    void add(const Rect &r);
+    void add_all() { all = true; count = 0; }
+    void reset() { all = false; count = 0; }
+    bool empty() const { return !all && !count; }
+  };
+
+  // how scaled and transformed blits pick source pixels
+  enum class SampleFilter {
+    NEAREST,  // closest source pixel
+    BILINEAR  // interpolate the four closest source pixels (not for paletted sources)
+  };
+
   struct Surface {
 
     uint8_t                        *data;                     // pointer to pixel data (for `rgba` format has pre-multiplied alpha)
@@ -95,11 +135,15 @@ namespace blit {
     uint16_t                        row_stride;               // bytes per row
 
     Surface                        *mask = nullptr;           // optional mask
-    Pen                            *palette;                  // palette entries (for paletted images)
+    Pen                            *palette = nullptr;        // palette entries (for paletted images)
 
     SpriteSheet                    *sprites = nullptr;        // active spritesheet
 
     uint8_t                         transparent_index = 0;    // index of transparent colour (for paletted surfaces)
+    bool                            opaque = false;           // set if no pixels are transparent, allows blits to copy rows directly
+    SampleFilter                    filter = SampleFilter::NEAREST; // sampling for scaled and transformed blits onto this surface
+
+    DamageTracker                  *damage = nullptr;         // optional record of the areas drawn to
 
     // blend functions
     blit::PenBlendFunc              pbf;
@@ -122,11 +166,14 @@ namespace blit {
     __attribute__((always_inline)) inline uint8_t* ptr(const Point &p)  { return data + p.x * pixel_stride + p.y * row_stride; }
     __attribute__((always_inline)) inline uint8_t* ptr(const int32_t &x, const int32_t &y) { return data + x * pixel_stride + y * row_stride; }
 
+    __attribute__((always_inline)) inline void add_damage(const Rect &r) { if (damage) damage->add(r); }
+
     __attribute__((always_inline)) inline uint32_t offset(const Rect &r) { return r.x + r.y * bounds.w; }
     __attribute__((always_inline)) inline uint32_t offset(const Point &p) { return p.x + p.y * bounds.w; }
     __attribute__((always_inline)) inline uint32_t offset(const int32_t &x, const int32_t &y) { return x + y * bounds.w; }
 
     void generate_mipmaps(uint8_t depth);
+    void mipmap_span(Surface *src, Point p, int32_t cnt, const Point *uv, float lod);
 
     void clear();
     void pixel(const Point &p);
@@ -136,11 +183,19 @@ namespace blit {
     void circle(const Point &c, int32_t r);
 
     void line(const Point&p1, const Point&p2);
+    void polyline(const std::vector<Point> &points, bool closed = false);
+    void polyline(const Point *points, uint32_t count, bool closed = false);
     void triangle(Point p1, Point p2, Point p3);
-    void polygon(std::vector<Point> p);
+    void shaded_triangle(Point p1, Pen c1, Point p2, Pen c2, Point p3, Pen c3);
+    void textured_triangle(Surface *src, Rect sr, Point p1, Vec2 uv1, Point p2, Vec2 uv2, Point p3, Vec2 uv3, SampleMode mode = SampleMode::WRAP);
+    void textured_triangle(Surface *src, Rect sr, Point p1, Vec3 uvz1, Point p2, Vec3 uvz2, Point p3, Vec3 uvz3, SampleMode mode = SampleMode::WRAP);
+    void polygon(const std::vector<Point> &points, FillRule rule = FillRule::EVEN_ODD);
+    void polygon(const Point *points, uint32_t count, FillRule rule = FillRule::EVEN_ODD);
 
     void text(const std::string &message, const Font &font, const Rect &r, bool variable = true, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
     void text(const std::string &message, const Font &font, const Point &p, bool variable = true, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
+    void text(const TextLayout &layout, const Rect &r, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
+    void text(const TextLayout &layout, const Point &p, TextAlign align = TextAlign::top_left, Rect clip = Rect(0, 0, 1000, 1000));
     Size measure_text(const std::string &message, const Font &font, bool variable = true);
     std::string wrap_text(const std::string &message, int32_t width, const Font &font, bool variable = true, bool words = true);
 
@@ -150,6 +205,7 @@ namespace blit {
     void blit(Surface *src, Rect r, Point p, bool hflip = false);
     void stretch_blit(Surface *src, Rect sr, Rect dr);
     void stretch_blit_vspan(Surface *src, Point uv, uint16_t sc, Point p, int16_t dc);
+    void transform_blit(Surface *src, Rect sr, const Mat3 &m, SampleMode mode = SampleMode::CLIP);
 
     void custom_blend(Surface *src, Rect r, Point p, std::function<void(uint8_t *psrc, uint8_t *pdest, int16_t c)> f);
     void custom_modify(Rect r, std::function<void(uint8_t *p, int16_t c)> f);
@@ -165,7 +221,9 @@ namespace blit {
 
 
     void blit_sprite(const Rect &src, const Point &p, const uint8_t &t = 0);
+    void blit_sprite(const Rect &src, const Point &p, const uint8_t &t, BlitBlendFunc blend_func);
     void stretch_blit_sprite(const Rect&src, const Rect &r, const uint8_t &t = 0);
+    void stretch_blit_sprite(const Rect&src, const Rect &r, const uint8_t &t, BlitBlendFunc blend_func);
 
     void sprite(const Rect &sprite, const Point &position, const uint8_t &transform = 0);
     void sprite(const Point &sprite, const Point &position, const uint8_t &transform = 0);
@@ -175,13 +233,13 @@ namespace blit {
     void sprite(const Point &sprite, const Point &position, const Point &origin, const uint8_t &transform = 0);
     void sprite(const uint16_t &sprite, const Point &position, const Point &origin, const uint8_t &transform = 0);
 
-    void sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0);
-    void sprite(const Point &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0);
-    void sprite(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0);
+    void sprite(const Rect &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
+    void sprite(const Point &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
+    void sprite(const uint16_t &sprite, const Point &position, const Point &origin, const Vec2 &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
 
-    void sprite(const Rect &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0);
-    void sprite(const Point &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0);
-    void sprite(const uint16_t &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0);
+    void sprite(const Rect &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
+    void sprite(const Point &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
+    void sprite(const uint16_t &sprite, const Point &position, const Point &origin, const float &scale, const uint8_t &transform = 0, const float &rotation = 0.0f);
 
     //extern void texture_triangle(int32_t x1, int32_t y1, int32_t u1, int32_t v1, int32_t x2, int32_t y2, int32_t u2, int32_t v2, int32_t x3, int32_t y3, int32_t u3, int32_t v3);
 
@@ -193,4 +251,31 @@ namespace blit {
     void vertical_scale_span_blit(const point &p, const uint16_t length, surface *texture, const point &st, const point &et);*/
   };
 
+  float mipmap_lod(const Vec2 &dx, const Vec2 &dy);
+
+  // Line breaks, line widths and glyph positions of a message, worked out
+  // once so the text can be measured and drawn (with `Surface::text`) as
+  // often as needed. Calling `layout()` with new text reuses the storage.
+  struct TextLayout {
+    struct Line {
+      uint32_t                      start, end;               // characters on the line, not including the break
+      int32_t                       width;                    // width in pixels
+    };
+
+    std::string                     message;
+    const Font                     *font;
+    int32_t                         width;                    // width to wrap at, 0 to only break at newlines
+    bool                            variable;                 // use variable width characters
+    bool                            words;                    // wrap at spaces where possible
+
+    std::vector<Line>               lines;
+    std::vector<int16_t>            x;                        // position of each character from the start of its line
+    Size                            size;                     // size of all lines, as `Surface::measure_text`
+
+    TextLayout(const std::string &message, const Font &font, int32_t width = 0, bool variable = true, bool words = true);
+
+    void layout(const std::string &message);
+    Point position(uint32_t index) const;
+  };
+
 }
\ No newline at end of file
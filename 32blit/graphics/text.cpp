@@ -1,4 +1,5 @@
 
+#include <memory>
 #include <string>
 
 #include "../types/point.hpp"
@@ -10,6 +11,54 @@ using namespace blit;
 
 namespace blit {
 
+  uint8_t get_char_width(const Font &font, char c, bool variable) {
+    if (!variable)
+      return font.char_w;
+
+    uint8_t chr_idx = c & 0x7F;
+    chr_idx = chr_idx < ' ' ? 0 : chr_idx - ' ';
+
+    return font.char_w_variable[chr_idx];
+  }
+
+  // draws one glyph with its top left corner at `c`
+  static void draw_glyph(Surface *dest, const GlyphRuns &glyphs, uint8_t chr_idx, const Point &c, const Rect &clip, PenBlendFunc blend_func) {
+    Rect glyph = clip.intersection(Rect(c.x, c.y, glyphs.char_w, glyphs.char_h));
+    if (glyph.empty())
+      return;
+
+    dest->add_damage(glyph);
+
+    const GlyphRun *run = glyphs.runs.data() + glyphs.start[chr_idx];
+    const GlyphRun *end = glyphs.runs.data() + glyphs.start[chr_idx + 1];
+
+    if (glyph.w == glyphs.char_w && glyph.h == glyphs.char_h) {
+      // glyph entirely visible
+      for (; run != end; run++)
+        blend_func(&dest->pen, dest, dest->offset(c.x + run->x, c.y + run->y), run->w);
+    } else {
+      for (; run != end; run++) {
+        int32_t y = c.y + run->y;
+        if (y < glyph.y || y >= glyph.y + glyph.h)
+          continue;
+
+        int32_t x0 = std::max(c.x + run->x, glyph.x);
+        int32_t x1 = std::min(c.x + run->x + run->w, glyph.x + glyph.w);
+        if (x0 < x1)
+          blend_func(&dest->pen, dest, dest->offset(x0, y), x1 - x0);
+      }
+    }
+  }
+
+  // width of the line of `message` starting at `start`
+  static int32_t line_width(const std::string &message, size_t start, const Font &font, bool variable) {
+    int32_t w = 0;
+    for (size_t i = start; i < message.length() && message[i] != '\n'; i++)
+      w += get_char_width(font, message[i], variable);
+
+    return w;
+  }
+
   /**
    * TODO: Document this function
    *
@@ -38,8 +87,7 @@ namespace blit {
       clip = r;
 
     // clamp clip rect to screen
-    clip.w = std::min(clip.w, bounds.w - clip.x);
-    clip.h = std::min(clip.h, bounds.h - clip.y);
+    clip = clip.intersection(Rect(0, 0, bounds.w, bounds.h));
 
     // check vertical alignment
     if ((align & 0b11) != TextAlign::top) {
@@ -53,16 +101,17 @@ namespace blit {
 
     // check horizontal alignment
     if ((align & 0b1100) != TextAlign::left) {
-      Size bounds = measure_text(message.substr(0, message.find_first_of('\n')), font, variable);
+      int32_t w = line_width(message, 0, font, variable);
 
       if ((align & 0b1100) == TextAlign::right)
-        c.x += r.w - bounds.w;
+        c.x += r.w - w;
       else // center
-        c.x += (r.w - bounds.w) / 2;
+        c.x += (r.w - w) / 2;
     }
 
-    const int height_bytes = (font.char_h + 7) / 8;
-    const int char_size = font.char_w * height_bytes;
+    const GlyphRuns &glyphs = glyph_runs(font);
+
+    PenBlendFunc blend_func = get_pen_blend_func(this);
 
     size_t char_off = 0;
     for (char chr : message) {
@@ -73,21 +122,7 @@ namespace blit {
 
       uint8_t char_width = 0;
 
-      const uint8_t* font_chr = &font.data[chr_idx * char_size];
-
-      for (uint8_t y = 0; y < font.char_h; y++) {
-        uint32_t po = offset(Point(c.x, c.y + y));
-
-        for (uint8_t x = 0; x < font.char_w; x++) {
-          int bit = 1 << (y & 7);
-          if (font_chr[x * height_bytes + y / 8] & bit) {
-            if(clip.contains(Point(c.x + x, c.y + y)))
-              pbf(&pen, this, po, 1);
-          }
-
-          po++;
-        }
-      }
+      draw_glyph(this, glyphs, chr_idx, c, clip, blend_func);
 
       if (!variable)
         char_width = font.char_w;
@@ -102,16 +137,12 @@ namespace blit {
 
         // check horizontal alignment
         if ((align & 0b1100) != TextAlign::left) {
-          auto end = message.find_first_of('\n', char_off + 1);
-          if(end != std::string::npos)
-            end -= char_off + 1;
-
-          Size bounds = measure_text(message.substr(char_off + 1, end), font, variable);
+          int32_t w = line_width(message, char_off + 1, font, variable);
 
           if ((align & 0b1100) == TextAlign::right)
-            c.x += r.w - bounds.w;
+            c.x += r.w - w;
           else // center
-            c.x += (r.w - bounds.w) / 2;
+            c.x += (r.w - w) / 2;
         }
       }
 
@@ -119,14 +150,245 @@ namespace blit {
     }
   }
 
-  uint8_t get_char_width(const Font &font, char c, bool variable) {
-    if (!variable)
-      return font.char_w;
+  /**
+   * Draw text that has already been laid out
+   *
+   * \param layout
+   * \param r
+   * \param align
+   * \param clip
+   */
+  void Surface::text(const TextLayout &layout, const Rect &r, TextAlign align, Rect clip) {
+    const Font &font = *layout.font;
 
-    uint8_t chr_idx = c & 0x7F;
-    chr_idx = chr_idx < ' ' ? 0 : chr_idx - ' ';
+    // default clip rect to rect if passed in
+    if(r.w > 0 && clip.w == 1000)
+      clip = r;
 
-    return font.char_w_variable[chr_idx];
+    // clamp clip rect to screen
+    clip = clip.intersection(Rect(0, 0, bounds.w, bounds.h));
+
+    Point c(r.x, r.y);
+
+    // check vertical alignment
+    if ((align & 0b11) == TextAlign::bottom)
+      c.y += r.h - layout.size.h;
+    else if ((align & 0b11) != TextAlign::top)
+      c.y += (r.h - layout.size.h) / 2;
+
+    const GlyphRuns &glyphs = glyph_runs(font);
+
+    PenBlendFunc blend_func = get_pen_blend_func(this);
+
+    for (auto &line : layout.lines) {
+      // check horizontal alignment
+      c.x = r.x;
+      if ((align & 0b1100) == TextAlign::right)
+        c.x += r.w - line.width;
+      else if ((align & 0b1100) != TextAlign::left)
+        c.x += (r.w - line.width) / 2;
+
+      // skip lines outside of the clip rect
+      if (c.y < clip.y + clip.h && c.y + font.char_h > clip.y) {
+        for (uint32_t i = line.start; i < line.end; i++) {
+          uint8_t chr_idx = layout.message[i] & 0x7F;
+          chr_idx = chr_idx < ' ' ? 0 : chr_idx - ' ';
+
+          draw_glyph(this, glyphs, chr_idx, Point(c.x + layout.x[i], c.y), clip, blend_func);
+        }
+      }
+
+      c.y += font.char_h + font.spacing_y;
+    }
+  }
+
+  /**
+   * Draw text that has already been laid out
+   *
+   * \param layout
+   * \param p
+   * \param align
+   * \param clip
+   */
+  void Surface::text(const TextLayout &layout, const Point &p, TextAlign align, Rect clip) {
+    text(layout, Rect(p.x, p.y, 0, 0), align, clip);
+  }
+
+  /**
+   * Lay out a message
+   *
+   * \param message
+   * \param font
+   * \param width width to wrap lines at, 0 to only break at newlines
+   * \param variable use variable width characters
+   * \param words wrap at spaces where possible, otherwise at any character
+   */
+  TextLayout::TextLayout(const std::string &message, const Font &font, int32_t width, bool variable, bool words)
+    : font(&font), width(width), variable(variable), words(words) {
+    layout(message);
+  }
+
+  /**
+   * Lay out new text with the same font and settings
+   *
+   * Lines are broken at newlines and, if a width is set, wherever the next
+   * character would pass it. Everything is worked out in one pass over the
+   * message.
+   *
+   * \param message
+   */
+  void TextLayout::layout(const std::string &message) {
+    this->message = message;
+
+    lines.clear();
+    x.resize(message.length());
+
+    Line line = {0, 0, 0};
+    int32_t cx = 0;
+
+    // the last space on the current line, its position and the position
+    // after it
+    int32_t space = -1, space_x = 0, after_space_x = 0;
+
+    for (uint32_t i = 0; i < message.length(); i++) {
+      char chr = message[i];
+
+      if (chr == '\n') {
+        x[i] = cx;
+        line.end = i;
+        line.width = cx;
+        lines.push_back(line);
+
+        line.start = i + 1;
+        cx = 0;
+        space = -1;
+        continue;
+      }
+
+      int32_t w = get_char_width(*font, chr, variable);
+
+      if (width > 0 && cx + w > width && i > line.start) {
+        if (words && chr == ' ') {
+          // break at this space and drop it
+          x[i] = cx;
+          line.end = i;
+          line.width = cx;
+          lines.push_back(line);
+
+          line.start = i + 1;
+          cx = 0;
+          space = -1;
+          continue;
+        }
+
+        if (words && space >= 0) {
+          // break at the last space, what followed it moves to the next line
+          line.end = space;
+          line.width = space_x;
+          lines.push_back(line);
+
+          line.start = space + 1;
+          for (uint32_t j = line.start; j < i; j++)
+            x[j] -= after_space_x;
+          cx -= after_space_x;
+        } else {
+          // break before this character
+          line.end = i;
+          line.width = cx;
+          lines.push_back(line);
+
+          line.start = i;
+          cx = 0;
+        }
+
+        space = -1;
+      }
+
+      x[i] = cx;
+      cx += w;
+
+      if (chr == ' ') {
+        space = i;
+        space_x = x[i];
+        after_space_x = cx;
+      }
+    }
+
+    line.end = message.length();
+    line.width = cx;
+    lines.push_back(line);
+
+    size = Size(0, lines.size() * (font->char_h + font->spacing_y));
+    for (auto &l : lines)
+      size.w = std::max(size.w, l.width);
+  }
+
+  /**
+   * Get the position of a character relative to the top left of the text
+   *
+   * \param index
+   */
+  Point TextLayout::position(uint32_t index) const {
+    // last line starting at or before index
+    uint32_t l = std::upper_bound(lines.begin(), lines.end(), index, [](uint32_t i, const Line &line) { return i < line.start; }) - lines.begin();
+    l = l ? l - 1 : 0;
+
+    int32_t px = index < x.size() ? x[index] : lines[l].width;
+    return Point(px, l * (font->char_h + font->spacing_y));
+  }
+
+  /**
+   * Get a font's glyphs as horizontal runs of set pixels
+   *
+   * The runs are built the first time a font is used and kept for later
+   * calls. Fonts are matched by their glyph data.
+   *
+   * \param font
+   */
+  const GlyphRuns &glyph_runs(const Font &font) {
+    static std::vector<std::unique_ptr<GlyphRuns>> cache;
+
+    for (auto &g : cache) {
+      if (g->data == font.data && g->char_w == font.char_w && g->char_h == font.char_h)
+        return *g;
+    }
+
+    GlyphRuns *g = new GlyphRuns;
+    g->data = font.data;
+    g->char_w = font.char_w;
+    g->char_h = font.char_h;
+
+    const int height_bytes = (font.char_h + 7) / 8;
+    const int char_size = font.char_w * height_bytes;
+
+    for (int chr_idx = 0; chr_idx < GlyphRuns::glyph_count; chr_idx++) {
+      const uint8_t* font_chr = &font.data[chr_idx * char_size];
+
+      g->start[chr_idx] = g->runs.size();
+
+      for (uint8_t y = 0; y < font.char_h; y++) {
+        int bit = 1 << (y & 7);
+        uint8_t x = 0;
+
+        while (x < font.char_w) {
+          if (!(font_chr[x * height_bytes + y / 8] & bit)) {
+            x++;
+            continue;
+          }
+
+          uint8_t x0 = x;
+          while (x < font.char_w && (font_chr[x * height_bytes + y / 8] & bit))
+            x++;
+
+          g->runs.push_back({x0, y, uint8_t(x - x0)});
+        }
+      }
+    }
+
+    g->start[GlyphRuns::glyph_count] = g->runs.size();
+
+    cache.emplace_back(g);
+    return *g;
   }
 
   Size Surface::measure_text(const std::string &message, const Font &font, bool variable) {
@@ -176,6 +438,7 @@ std::string Surface::wrap_text(const std::string &message, int32_t width, const
 
   int current_x = 0;
   size_t last_space = std::string::npos;
+  int after_space_x = 0; // current_x just after the last space
   size_t copied_off = 0;
 
   for (size_t i = 0; i < message.length(); i++) {
@@ -193,6 +456,9 @@ std::string Surface::wrap_text(const std::string &message, int32_t width, const
     int char_width = get_char_width(font, message[i], variable);
     current_x += char_width;
 
+    if (message[i] == ' ')
+      after_space_x = current_x;
+
     if (current_x > width) {
       if(!words || last_space == std::string::npos) {
         // no space to break at or we're not breaking on words
@@ -204,7 +470,7 @@ std::string Surface::wrap_text(const std::string &message, int32_t width, const
         ret += message.substr(copied_off, last_space - copied_off) + "\n";
         copied_off = last_space + 1; // don't copy the space
         last_space = std::string::npos;
-        current_x = measure_text(message.substr(copied_off, i - copied_off + 1), font, variable).w;
+        current_x -= after_space_x; // width of the characters after the space
       }
     }
   }
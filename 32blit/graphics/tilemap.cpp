@@ -1,10 +1,24 @@
 /*! \file tilemap.cpp
 */
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <cstring>
+#include "span.hpp"
 #include "tilemap.hpp"
+#include "../math/constants.hpp"
 
 namespace blit {
 
+  /**
+   * Create a tile size from a size in pixels, both sides must be powers of two.
+   *
+   * \param[in] size
+   */
+  TileSize<0, 0>::TileSize(const Size &size) : w(size.w), h(size.h), shift_x(tile_shift(size.w)), shift_y(tile_shift(size.h)) {
+    assert(w > 0 && h > 0 && !(w & (w - 1)) && !(h & (h - 1)));
+  }
+
   /**
    * Create a new tilemap.
    * 
@@ -12,8 +26,10 @@ namespace blit {
    * \param[in] transforms
    * \param[in] bounds
    * \param[in] sprites
+   * \param[in] tile_size Size of a tile in pixels, only used for maps with a run time tile size (`TileMapT<0, 0>`)
    */
-  TileMap::TileMap(uint8_t *tiles, uint8_t *transforms, Size bounds, SpriteSheet *sprites) : bounds(bounds), tiles(tiles), transforms(transforms), sprites(sprites) {
+  template<int TileW, int TileH, typename IndexType>
+  TileMapT<TileW, TileH, IndexType>::TileMapT(IndexType *tiles, uint8_t *transforms, Size bounds, SpriteSheet *sprites, Size tile_size) : bounds(bounds), tiles(tiles), transforms(transforms), sprites(sprites), tile_size(tile_size) {
     if (!transforms) {
       this->transforms = new uint8_t[bounds.w * bounds.h];
       std::memset(this->transforms, 0, bounds.w * bounds.h);
@@ -23,44 +39,45 @@ namespace blit {
   /**
    * TODO: Document
    */
-  int32_t TileMap::offset(const Point &p) {
-    int32_t cx = ((uint16_t)p.x) & (bounds.w - 1);
-    int32_t cy = ((uint16_t)p.y) & (bounds.h - 1);
-
-    if ((p.x ^ cx) | (p.y ^ cy)) {
-      if (repeat_mode == DEFAULT_FILL)
-        return default_tile_id;
-
-      if (repeat_mode == REPEAT)
-        return cx + cy * bounds.w;
-
-      return -1;
-    }
-
-    return cx + cy * bounds.w;
+  template<int TileW, int TileH, typename IndexType>
+  int32_t TileMapT<TileW, TileH, IndexType>::offset(const Point &p) {
+    return offset(p.x, p.y);
   }
 
   /**
-   * TODO: Document
+   * Get the offset of a tile in `tiles`, taking `repeat_mode` into account
+   * for tiles outside of the map.
    * 
    * \param[in] x
    * \param[in] y
+   * \return Offset of the tile, one past the end of the map for the `DEFAULT_FILL` tile (see `tile_at_offset`), or -1 if there is no tile there.
    */
-  int32_t TileMap::offset(const int16_t &x, const int16_t &y) {
-    int32_t cx = ((uint16_t)x) & (bounds.w - 1);
-    int32_t cy = ((uint16_t)y) & (bounds.h - 1);
+  template<int TileW, int TileH, typename IndexType>
+  int32_t TileMapT<TileW, TileH, IndexType>::offset(const int32_t &x, const int32_t &y) {
+    if (uint32_t(x) < uint32_t(bounds.w) && uint32_t(y) < uint32_t(bounds.h))
+      return x + y * bounds.w;
 
-    if ((x ^ cx) | (y ^ cy)) {
-      if (repeat_mode == DEFAULT_FILL)
-        return default_tile_id;
+    if (repeat_mode == DEFAULT_FILL)
+      return bounds.w * bounds.h;
 
-      if (repeat_mode == REPEAT)
-        return cx + cy * bounds.w;
+    if (repeat_mode == REPEAT) {
+      int32_t cx, cy;
 
-      return -1;
+      // power of two sizes wrap with a mask
+      if (!(bounds.w & (bounds.w - 1)) && !(bounds.h & (bounds.h - 1))) {
+        cx = x & (bounds.w - 1);
+        cy = y & (bounds.h - 1);
+      } else {
+        cx = x % bounds.w;
+        cy = y % bounds.h;
+        cx += cx < 0 ? bounds.w : 0;
+        cy += cy < 0 ? bounds.h : 0;
+      }
+
+      return cx + cy * bounds.w;
     }
 
-    return cx + cy * bounds.w;
+    return -1;
   }
 
   /**
@@ -69,11 +86,12 @@ namespace blit {
    * \param[in] p Point denoting the tile x/y position in the map.
    * \return Bitmask of flags for specified tile.
    */
-  uint8_t TileMap::tile_at(const Point &p) {
+  template<int TileW, int TileH, typename IndexType>
+  IndexType TileMapT<TileW, TileH, IndexType>::tile_at(const Point &p) {
     int32_t o = offset(p);
 
     if(o != -1)
-      return tiles[o];
+      return tile_at_offset(o);
 
     return 0;
   }
@@ -84,110 +102,696 @@ namespace blit {
    * \param[in] p Point denoting the tile x/y position in the map.
    * \return Bitmask of transforms for specified tile.
    */
-  uint8_t TileMap::transform_at(const Point &p) {
+  template<int TileW, int TileH, typename IndexType>
+  uint8_t TileMapT<TileW, TileH, IndexType>::transform_at(const Point &p) {
     int32_t o = offset(p);
 
     if (o != -1 && transforms)
-      return transforms[o];
+      return transform_at_offset(o);
 
     return 0;
   }
 
-  /**
-   * Draw tilemap to a specified destination surface, with clipping.
-   *
-   * \param[in] dest Destination surface.
-   * \param[in] viewport Clipping rectangle.
-   * \param[in] scanline_callback Functon called on every scanline, accepts the scanline y position, should return a transformation matrix.
-   */
-  void TileMap::draw(Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback) {
+  // draws a span from the sprite sheet itself, see `TileMapT::texture_span`
+  template<typename Map>
+  static void nearest_span(Map *map, Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 dwc) {
+    if (!steppable(swc, dwc))
+      return;
+
+    const auto &ts = map->tile_size;
+    Surface *src = map->sprites;
+    TileSheet<decltype(map->tile_size)> sheet(ts, src);
+    BlitBlendFunc blend_func = get_blit_blend_func(src, dest);
+
+    int32_t doff = dest->offset(s.x, s.y);
+    dest->add_damage(Rect(s.x, s.y, c, 1));
+
+    if (dwc.x == 1.0f && dwc.y == 0.0f) {
+      int32_t wcx = floorf(swc.x);
+      int32_t wcy = floorf(swc.y);
+      int32_t v = wcy & (ts.h - 1);
+
+      do {
+        int32_t u = wcx & (ts.w - 1);
+        uint16_t n = std::min(uint16_t(ts.w - u), c);
+
+        int32_t toff = map->offset(wcx >> ts.shift_x, wcy >> ts.shift_y);
+
+        if (toff != -1) {
+          uint8_t transform = map->transform_at_offset(toff);
+          Point t = sheet.texel(map->tile_at_offset(toff), transform, u, v);
+
+          blend_func(src, src->offset(t), dest, doff, n, sheet.step(transform));
+        }
+
+        wcx += n;
+        doff += n;
+        c -= n;
+      } while (c);
+
+      return;
+    }
+
+    uint8_t row_data[span_chunk * 4];
+    Surface row = scratch_row(src, row_data);
+    int32_t offsets[span_chunk];
+    blend_func = get_blit_blend_func(&row, dest);
+
+    const uint8_t stride = src->pixel_stride;
+    SpanStepper wc(swc, dwc);
+
+    for (int32_t cx = 0; cx < c; cx += span_chunk) {
+      int32_t n = std::min(span_chunk, c - cx);
+      int32_t run = 0; // first pixel not yet blended
+
+      for (int32_t i = 0; i < n; i++, wc.next()) {
+        Point p = wc.point();
+        int32_t toff = map->offset(p.x >> ts.shift_x, p.y >> ts.shift_y);
+
+        if (toff == -1) {
+          if (i > run) {
+            gather_pixels(src->data, offsets + run, row_data + run * stride, i - run, stride);
+            blend_func(&row, run, dest, doff + run, i - run, 1);
+          }
+
+          run = i + 1;
+          continue;
+        }
+
+        offsets[i] = src->offset(sheet.texel(map->tile_at_offset(toff), map->transform_at_offset(toff), p.x & (ts.w - 1), p.y & (ts.h - 1)));
+      }
+
+      if (n > run) {
+        gather_pixels(src->data, offsets + run, row_data + run * stride, n - run, stride);
+        blend_func(&row, run, dest, doff + run, n - run, 1);
+      }
+
+      doff += n;
+    }
+  }
+
+  // draws a span from the mipmaps of the sprite sheet at level of detail `lod`
+  template<typename Map>
+  static void trilinear_span(Map *map, Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 dwc, float lod) {
+    if (!steppable(swc, dwc))
+      return;
+
+    const auto &ts = map->tile_size;
+    TileSheet<decltype(map->tile_size)> sheet(ts, map->sprites);
+
+    SpanStepper wc(swc, dwc);
+    Point uv[span_chunk];
+
+    for (int32_t cx = 0; cx < c; cx += span_chunk) {
+      int32_t n = std::min(span_chunk, c - cx);
+
+      for (int32_t i = 0; i < n; i++, wc.next()) {
+        Point p = wc.point();
+        int32_t toff = map->offset(p.x >> ts.shift_x, p.y >> ts.shift_y);
+
+        if (toff == -1) {
+          uv[i].x = -1;
+          continue;
+        }
+
+        // sprite sheet coordinates, mipmap_span scales them to each level
+        uv[i] = sheet.texel(map->tile_at_offset(toff), map->transform_at_offset(toff), p.x & (ts.w - 1), p.y & (ts.h - 1));
+      }
+
+      dest->mipmap_span(map->sprites, Point(s.x + cx, s.y), n, uv, lod);
+    }
+  }
+
+  // draws a span with or without mipmaps to suit its scale, `dy` is the
+  // change in world coordinate between neighbouring spans
+  template<typename Map>
+  static void draw_span(Map *map, Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 dwc, Vec2 dy) {
+    float lod = map->sprites->mipmaps.size() > 1 ? mipmap_lod(dwc, dy) : 0.0f;
+
+    if (lod > 0.0f)
+      trilinear_span(map, dest, s, c, swc, dwc, lod);
+    else
+      nearest_span(map, dest, s, c, swc, dwc);
+  }
+
+  // draws a map with a scanline callback, see `TileMapT::draw`
+  template<typename Map>
+  static void draw_map(Map *map, Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback) {
     //bool not_scaled = (from.w - to.w) | (from.h - to.h);
 
     viewport = dest->clip.intersection(viewport);
 
+    const bool mipmapped = map->sprites->mipmaps.size() > 1;
+
     for (uint16_t y = viewport.y; y < viewport.y + viewport.h; y++) {
       Vec2 swc(viewport.x, y);
       Vec2 ewc(viewport.x + viewport.w, y);
+      Vec2 nwc(viewport.x, y + 1);
 
-      if (scanline_callback) {
-        Mat3 custom_transform = scanline_callback(y);
-        swc *= custom_transform;
-        ewc *= custom_transform;
+      const Mat3 &m = scanline_callback ? scanline_callback(y) : map->transform;
+      swc *= m;
+      ewc *= m;
+
+      if (mipmapped) {
+        // how far the transform moves down the map between scanlines
+        nwc *= m;
+        map->mipmap_texture_span(dest, Point(viewport.x, y), viewport.w, swc, ewc, nwc - swc);
       } else {
-        swc *= transform;
-        ewc *= transform;
+        map->texture_span(dest, Point(viewport.x, y), viewport.w, swc, ewc);
       }
+    }
+  }
 
-      texture_span(dest, Point(viewport.x, y), viewport.w, swc, ewc);
+  // draws a map from a table of scanline transforms, see `TileMapT::draw`
+  template<typename Map>
+  static void draw_map(Map *map, Surface *dest, Rect viewport, const ScanlineTransform *scanlines) {
+    if (!scanlines) {
+      draw_map(map, dest, viewport, std::function<Mat3(uint8_t)>());
+      return;
+    }
+
+    Rect r = dest->clip.intersection(viewport);
+    if (r.empty())
+      return;
+
+    const bool mipmapped = map->sprites->mipmaps.size() > 1;
+
+    // the clipped area's left edge and centre relative to the viewport
+    const float left = r.x - viewport.x;
+    const float centre = left + r.w / 2;
+
+    for (int32_t y = r.y; y < r.y + r.h; y++) {
+      int32_t i = y - viewport.y;
+      const ScanlineTransform &line = scanlines[i];
+      Vec2 swc = line.start + line.step * left;
+
+      // how far the map moves down the screen, measured against the
+      // neighbouring scanline
+      Vec2 dy;
+      if (mipmapped && viewport.h > 1) {
+        const ScanlineTransform &other = scanlines[i + 1 < viewport.h ? i + 1 : i - 1];
+        dy = (other.start + other.step * centre) - (line.start + line.step * centre);
+      }
+
+      draw_span(map, dest, Point(r.x, y), r.w, swc, line.step, dy);
     }
   }
 
-  /*
-  void tilemap::mipmap_texture_span(surface *dest, point s, uint16_t c, vec2 swc, vec2 ewc) {
-    // calculate the mipmap index to use for drawing
-    float span_length = (ewc - swc).length();
-    float mipmap = ((span_length / float(c)) / 2.0f);
-    int16_t mipmap_index = floor(mipmap);
-    uint8_t blend = (mipmap - floor(mipmap)) * 255;
+  /**
+   * Draw tilemap to a specified destination surface, with clipping.
+   *
+   * If the sprite sheet has mipmaps (see `Surface::generate_mipmaps`) they
+   * are used where the map is drawn scaled down.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] viewport Clipping rectangle.
+   * \param[in] scanline_callback Functon called on every scanline, accepts the scanline y position, should return a transformation matrix.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void TileMapT<TileW, TileH, IndexType>::draw(Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback) {
+    draw_map(this, dest, viewport, scanline_callback);
+  }
 
-    mipmap_index = mipmap_index >= (int)sprites->s.mipmaps.size() ? sprites->s.mipmaps.size() - 1 : mipmap_index;
-    mipmap_index = mipmap_index < 0 ? 0 : mipmap_index;
+  /**
+   * Draw tilemap to a specified destination surface from a table of
+   * scanline transforms, with clipping.
+   *
+   * Each scanline of the viewport has an entry giving the world coordinate
+   * of its first pixel and the step between pixels, so per-scanline effects
+   * (perspective, waves, parallax) cost a table lookup rather than a
+   * callback and two matrix transforms. Tables can be built with the
+   * `*_scanlines` helpers and kept between frames while they don't change.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] viewport Area of `dest` to draw to.
+   * \param[in] scanlines One entry for every scanline of `viewport`, or `nullptr` to draw with `transform`.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void TileMapT<TileW, TileH, IndexType>::draw(Surface *dest, Rect viewport, const ScanlineTransform *scanlines) {
+    draw_map(this, dest, viewport, scanlines);
+  }
 
-    dest->alpha = 255;
-    texture_span(dest, s, c, swc, ewc, mipmap_index);
+  /**
+   * Draw a span of the map, sampling the mipmaps of the sprite sheet to
+   * suit the scale the map is drawn at.
+   *
+   * Falls back to `texture_span` where the map is not scaled down.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   * \param[in] dy Change in world coordinate from one span to the next, used with the span's own step to choose the mipmap level.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void TileMapT<TileW, TileH, IndexType>::mipmap_texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc, Vec2 dy) {
+    draw_span(this, dest, s, c, swc, (ewc - swc) / float(c), dy);
+  }
+
+  /**
+   * Draw a span of the map, sampling the sprite sheet at the nearest texel.
+   *
+   * Spans that step exactly one world pixel across per pixel (no scaling or
+   * rotation) are drawn a tile row at a time with one blend call each.
+   * Otherwise the world coordinate is stepped in fixed point and the texels
+   * gathered into a row that is blended between empty tiles.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void TileMapT<TileW, TileH, IndexType>::texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc) {
+    nearest_span(this, dest, s, c, swc, (ewc - swc) / float(c));
+  }
+
+  template struct TileMapT<8, 8, uint8_t>;
+  template struct TileMapT<8, 8, uint16_t>;
+  template struct TileMapT<16, 16, uint8_t>;
+  template struct TileMapT<16, 16, uint16_t>;
+  template struct TileMapT<32, 32, uint8_t>;
+  template struct TileMapT<32, 32, uint16_t>;
+  template struct TileMapT<0, 0, uint8_t>;
+  template struct TileMapT<0, 0, uint16_t>;
+
+  /**
+   * Create a streaming tile map, a map file must be opened with `open()`
+   * before it can be drawn.
+   *
+   * \param[in] sprites
+   * \param[in] budget Bytes of memory to use for the cache of chunks
+   * \param[in] tile_size Size of a tile in pixels, only used for maps with a run time tile size (`StreamingTileMapT<0, 0>`)
+   */
+  template<int TileW, int TileH, typename IndexType>
+  StreamingTileMapT<TileW, TileH, IndexType>::StreamingTileMapT(SpriteSheet *sprites, uint32_t budget, Size tile_size) : sprites(sprites), tile_size(tile_size), budget(budget) {
+  }
+
+  template<int TileW, int TileH, typename IndexType>
+  StreamingTileMapT<TileW, TileH, IndexType>::~StreamingTileMapT() {
+    delete[] tiles;
+    delete[] transforms;
+  }
+
+  /**
+   * Open a chunked map file and set up the cache for it.
+   *
+   * \param[in] filename
+   * \return `true` if the file is a chunked map with tile indices the size of `IndexType`
+   */
+  template<int TileW, int TileH, typename IndexType>
+  bool StreamingTileMapT<TileW, TileH, IndexType>::open(std::string filename) {
+    delete[] tiles;
+    delete[] transforms;
+    tiles = nullptr;
+    transforms = nullptr;
+    pages = 0;
+    slots.clear();
+
+    packed_tilemap header;
+    if (!file.open(filename) || file.read(0, sizeof(header), (char *)&header) != sizeof(header))
+      return false;
+
+    auto power_of_two = [](uint8_t v) { return v && !(v & (v - 1)); };
+
+    if (memcmp(header.type, "CHUNKMAP", 8) != 0 || header.index_size != sizeof(IndexType) || !power_of_two(header.chunk_w) || !power_of_two(header.chunk_h)) {
+      file.close();
+      return false;
+    }
+
+    bounds = Size(header.width, header.height);
+    chunk_size = Size(header.chunk_w, header.chunk_h);
+    chunk_shift_x = tile_shift(chunk_size.w);
+    chunk_shift_y = tile_shift(chunk_size.h);
+    chunks = Size((bounds.w + chunk_size.w - 1) >> chunk_shift_x, (bounds.h + chunk_size.h - 1) >> chunk_shift_y);
+    has_transforms = header.flags & 1;
 
-    if (++mipmap_index < sprites->s.mipmaps.size()) {
-      dest->alpha = blend;
-      texture_span(dest, s, c, swc, ewc, mipmap_index);
+    const int32_t chunk_tiles = chunk_size.w * chunk_size.h;
+    chunk_bytes = chunk_tiles * (sizeof(IndexType) + (has_transforms ? 1 : 0));
+
+    // a truncated file would otherwise only fail once a missing chunk is loaded
+    if (file.get_length() < sizeof(packed_tilemap) + uint64_t(chunks.w * chunks.h) * chunk_bytes) {
+      file.close();
+      return false;
     }
-  }*/
+
+    // pages always have transforms so they can be drawn like any other map
+    int32_t n = budget / (chunk_tiles * (sizeof(IndexType) + 1));
+    pages = std::max(1, std::min(std::min(n, chunks.w * chunks.h), 32767));
+
+    tiles = new IndexType[pages * chunk_tiles + 1];
+    transforms = new uint8_t[pages * chunk_tiles + 1];
+    transforms[pages * chunk_tiles] = 0;
+
+    slots.assign(chunks.w * chunks.h, -1);
+    page_chunks.assign(pages, -1);
+    page_used.assign(pages, 0);
+    frame = 0;
+    stats = {};
+
+    return true;
+  }
+
+  // wraps a tile coordinate into the map for `REPEAT`
+  template<int TileW, int TileH, typename IndexType>
+  int32_t StreamingTileMapT<TileW, TileH, IndexType>::wrap(int32_t v, int32_t size) {
+    if (!(size & (size - 1)))
+      return v & (size - 1);
+
+    v %= size;
+    return v < 0 ? v + size : v;
+  }
 
   /**
-   * TODO: Document
-   * 
-   * \param[in] dest
-   * \param[in] s
-   * \param[in] c
-   * \param[in] swc
-   * \param[in] ewc
+   * Load the chunks covering an area of the map and read ahead in the
+   * direction it has moved since the last update, call before drawing.
+   *
+   * Chunks needed for the area replace the least recently used ones. At
+   * most `read_ahead` more chunks are read ahead, and only into pages that
+   * aren't needed for the area.
+   *
+   * \param[in] view Area of the map about to be drawn, in world pixels
    */
-  void TileMap::texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc) {
-    Surface *src = sprites;
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::update(const Rect &view) {
+    if (slots.empty())
+      return;
 
-    Vec2 wc = swc;
-    Vec2 dwc = (ewc - swc) / float(c);
-    int32_t doff = dest->offset(s.x, s.y);
-    do {
-      int16_t wcx = floorf(wc.x);
-      int16_t wcy = floorf(wc.y);
+    frame++;
+    tiles[pages * chunk_size.w * chunk_size.h] = default_tile_id;
 
-      int32_t toff = offset(wcx >> 3, wcy >> 3);
+    int32_t tx = view.x >> tile_size.shift_x;
+    int32_t ty = view.y >> tile_size.shift_y;
+    int32_t tx2 = (view.x + view.w - 1) >> tile_size.shift_x;
+    int32_t ty2 = (view.y + view.h - 1) >> tile_size.shift_y;
 
-      if (toff != -1) {
-        uint8_t tile_id = tiles[toff];
-        uint8_t transform = transforms[toff];
+    touch(tx, ty, tx2, ty2, false);
 
-        // coordinate within sprite
-        uint8_t u = wcx & 0b111;
-        uint8_t v = wcy & 0b111;
+    if (frame > 1) {
+      ahead_left = read_ahead;
 
-        // if this tile has a transform then modify the uv coordinates
-        if (transform) {
-          v = (transform & 0b010) ? (7 - v) : v;
-          u = (transform & 0b100) ? (7 - u) : u;
-          if (transform & 0b001) { uint8_t tmp = u; u = v; v = tmp; }
-        }
+      int32_t dx = view.x > last_view.x ? 1 : (view.x < last_view.x ? -1 : 0);
+      int32_t dy = view.y > last_view.y ? 1 : (view.y < last_view.y ? -1 : 0);
+
+      // the next column and row of chunks, including the corner between them
+      if (dx)
+        touch(dx > 0 ? tx2 + 1 : tx - chunk_size.w, ty, dx > 0 ? tx2 + chunk_size.w : tx - 1, ty2, true);
+
+      if (dy)
+        touch(tx - (dx < 0 ? chunk_size.w : 0), dy > 0 ? ty2 + 1 : ty - chunk_size.h, tx2 + (dx > 0 ? chunk_size.w : 0), dy > 0 ? ty2 + chunk_size.h : ty - 1, true);
+    }
+
+    last_view = view;
+  }
+
+  // loads or marks as used the chunks covering an area of tiles
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::touch(int32_t tx, int32_t ty, int32_t tx2, int32_t ty2, bool ahead) {
+    if (repeat_mode == REPEAT) {
+      tx2 = std::min(tx2, tx + bounds.w - 1);
+      ty2 = std::min(ty2, ty + bounds.h - 1);
+    } else {
+      tx = std::max(tx, 0);
+      ty = std::max(ty, 0);
+      tx2 = std::min(tx2, bounds.w - 1);
+      ty2 = std::min(ty2, bounds.h - 1);
+    }
+
+    for (int32_t y = ty; y <= ty2; ) {
+      int32_t wy = wrap(y, bounds.h);
 
-        // sprite sheet coordinates for top left corner of sprite
-        u += (tile_id & 0b1111) * 8;
-        v += (tile_id >> 4) * 8;
+      for (int32_t x = tx; x <= tx2; ) {
+        int32_t wx = wrap(x, bounds.w);
+        int32_t chunk = (wx >> chunk_shift_x) + (wy >> chunk_shift_y) * chunks.w;
 
-        dest->bbf(src, src->offset(u, v), dest, doff, 1, 1);
+        if (slots[chunk] >= 0)
+          page_used[slots[chunk]] = frame;
+        else if (!load(chunk, ahead) && ahead)
+          return;
+
+        // on to the next chunk, or the start of the map if it wraps first
+        x += std::min(chunk_size.w - (wx & (chunk_size.w - 1)), bounds.w - wx);
+      }
+
+      y += std::min(chunk_size.h - (wy & (chunk_size.h - 1)), bounds.h - wy);
+    }
+  }
+
+  // reads a chunk into a free page or the least recently used one
+  template<int TileW, int TileH, typename IndexType>
+  bool StreamingTileMapT<TileW, TileH, IndexType>::load(int32_t chunk, bool ahead) {
+    if (ahead && !ahead_left)
+      return false;
+
+    // pages needed this frame are never evicted
+    int32_t page = -1;
+    for (int32_t i = 0; i < pages; i++) {
+      if (page_chunks[i] < 0) {
+        page = i;
+        break;
       }
 
-      wc += dwc;
-      doff++;
-    } while (--c);
+      if (page_used[i] != frame && (page < 0 || page_used[i] < page_used[page]))
+        page = i;
+    }
+
+    if (page < 0) {
+      stats.misses += !ahead;
+      return false;
+    }
+
+    if (page_chunks[page] >= 0) {
+      slots[page_chunks[page]] = -1;
+      stats.evictions++;
+    }
+
+    const int32_t n = chunk_size.w * chunk_size.h;
+    const uint32_t o = sizeof(packed_tilemap) + chunk * chunk_bytes;
+
+    bool read = file.read(o, n * sizeof(IndexType), (char *)(tiles + page * n)) == int32_t(n * sizeof(IndexType));
+    if (has_transforms)
+      read = read && file.read(o + n * sizeof(IndexType), n, (char *)(transforms + page * n)) == n;
+    else
+      memset(transforms + page * n, 0, n);
+
+    // leave the chunk unloaded and the page free if the read came up short
+    if (!read) {
+      page_chunks[page] = -1;
+      stats.misses += !ahead;
+      return false;
+    }
+
+    page_chunks[page] = chunk;
+    page_used[page] = frame;
+    slots[chunk] = page;
+
+    if (ahead) {
+      ahead_left--;
+      stats.prefetches++;
+    } else {
+      stats.loads++;
+    }
+
+    return true;
+  }
+
+  /**
+   * Get the offset of a tile in `tiles`, taking `repeat_mode` into account
+   * for tiles outside of the map.
+   *
+   * \param[in] p
+   * \return Offset of the tile, or -1 if there is no tile there or its chunk isn't loaded.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  int32_t StreamingTileMapT<TileW, TileH, IndexType>::offset(const Point &p) {
+    return offset(p.x, p.y);
+  }
+
+  /**
+   * Get the offset of a tile in `tiles`, taking `repeat_mode` into account
+   * for tiles outside of the map.
+   *
+   * \param[in] x
+   * \param[in] y
+   * \return Offset of the tile, or -1 if there is no tile there or its chunk isn't loaded.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  int32_t StreamingTileMapT<TileW, TileH, IndexType>::offset(const int32_t &x, const int32_t &y) {
+    if (slots.empty())
+      return -1;
+
+    int32_t cx = x, cy = y;
+
+    if (uint32_t(x) >= uint32_t(bounds.w) || uint32_t(y) >= uint32_t(bounds.h)) {
+      if (repeat_mode == DEFAULT_FILL)
+        return pages * chunk_size.w * chunk_size.h;
+
+      if (repeat_mode != REPEAT)
+        return -1;
+
+      cx = wrap(x, bounds.w);
+      cy = wrap(y, bounds.h);
+    }
+
+    int32_t page = slots[(cx >> chunk_shift_x) + (cy >> chunk_shift_y) * chunks.w];
+    if (page < 0)
+      return -1;
+
+    return (page << (chunk_shift_x + chunk_shift_y)) + (cx & (chunk_size.w - 1)) + ((cy & (chunk_size.h - 1)) << chunk_shift_x);
+  }
+
+  /**
+   * Get the tile at a position in the map.
+   *
+   * \param[in] p Point denoting the tile x/y position in the map.
+   * \return Index of the tile, 0 if its chunk isn't loaded.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  IndexType StreamingTileMapT<TileW, TileH, IndexType>::tile_at(const Point &p) {
+    int32_t o = offset(p);
+
+    if (o != -1)
+      return tiles[o];
+
+    return 0;
+  }
+
+  /**
+   * Get transform for a specific tile.
+   *
+   * \param[in] p Point denoting the tile x/y position in the map.
+   * \return Bitmask of transforms for specified tile.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  uint8_t StreamingTileMapT<TileW, TileH, IndexType>::transform_at(const Point &p) {
+    int32_t o = offset(p);
+
+    if (o != -1)
+      return transforms[o];
+
+    return 0;
+  }
+
+  /**
+   * Draw the loaded chunks of the map, see `TileMapT::draw`.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] viewport Clipping rectangle.
+   * \param[in] scanline_callback Functon called on every scanline, accepts the scanline y position, should return a transformation matrix.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::draw(Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback) {
+    draw_map(this, dest, viewport, scanline_callback);
+  }
+
+  /**
+   * Draw the loaded chunks of the map from a table of scanline transforms,
+   * see `TileMapT::draw`.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] viewport Area of `dest` to draw to.
+   * \param[in] scanlines One entry for every scanline of `viewport`, or `nullptr` to draw with `transform`.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::draw(Surface *dest, Rect viewport, const ScanlineTransform *scanlines) {
+    draw_map(this, dest, viewport, scanlines);
+  }
+
+  /**
+   * Draw a span of the map from its mipmaps, see `TileMapT::mipmap_texture_span`.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   * \param[in] dy Change in world coordinate from one span to the next.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::mipmap_texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc, Vec2 dy) {
+    draw_span(this, dest, s, c, swc, (ewc - swc) / float(c), dy);
+  }
+
+  /**
+   * Draw a span of the map, see `TileMapT::texture_span`.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   */
+  template<int TileW, int TileH, typename IndexType>
+  void StreamingTileMapT<TileW, TileH, IndexType>::texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc) {
+    nearest_span(this, dest, s, c, swc, (ewc - swc) / float(c));
+  }
+
+  template struct StreamingTileMapT<8, 8, uint8_t>;
+  template struct StreamingTileMapT<8, 8, uint16_t>;
+  template struct StreamingTileMapT<16, 16, uint8_t>;
+  template struct StreamingTileMapT<16, 16, uint16_t>;
+  template struct StreamingTileMapT<32, 32, uint8_t>;
+  template struct StreamingTileMapT<32, 32, uint16_t>;
+  template struct StreamingTileMapT<0, 0, uint8_t>;
+  template struct StreamingTileMapT<0, 0, uint16_t>;
+
+  /**
+   * Fill a scanline table with a single affine transform, matching
+   * `TileMapT::draw` with `TileMapT::transform`.
+   *
+   * \param[out] table `viewport.h` entries to fill.
+   * \param[in] viewport Area the table will be drawn to.
+   * \param[in] transform Transform from screen to world coordinates.
+   */
+  void scanline_transforms(ScanlineTransform *table, const Rect &viewport, const Mat3 &transform) {
+    Vec2 step(transform.v00, transform.v10);
+
+    for (int32_t y = 0; y < viewport.h; y++) {
+      table[y].start = Vec2(viewport.x, viewport.y + y) * transform;
+      table[y].step = step;
+    }
+  }
+
+  /**
+   * Fill a scanline table with an affine transform whose scanlines are
+   * shifted sideways along a sine wave, for water and heat haze effects.
+   *
+   * \param[out] table `viewport.h` entries to fill.
+   * \param[in] viewport Area the table will be drawn to.
+   * \param[in] transform Transform from screen to world coordinates.
+   * \param[in] amplitude Largest shift in pixels.
+   * \param[in] wavelength Scanlines per cycle of the wave.
+   * \param[in] phase Position in the cycle at the top of the viewport in radians, advance it to animate the wave.
+   */
+  void wave_scanlines(ScanlineTransform *table, const Rect &viewport, const Mat3 &transform, float amplitude, float wavelength, float phase) {
+    scanline_transforms(table, viewport, transform);
+
+    const float k = 2.0f * pi / wavelength;
+    for (int32_t y = 0; y < viewport.h; y++)
+      table[y].start += table[y].step * (amplitude * sinf(phase + y * k));
+  }
+
+  /**
+   * Fill a scanline table that scrolls each scanline at its own rate,
+   * changing evenly from the top of the viewport to the bottom, for
+   * parallax floors and skies. The map is drawn unscaled so every span
+   * takes the tile row fast path.
+   *
+   * \param[out] table `viewport.h` entries to fill.
+   * \param[in] viewport Area the table will be drawn to.
+   * \param[in] scroll World coordinate of the top left of the viewport at a rate of 1.
+   * \param[in] top_rate Horizontal scroll rate of the first scanline.
+   * \param[in] bottom_rate Horizontal scroll rate of the last scanline.
+   */
+  void parallax_scanlines(ScanlineTransform *table, const Rect &viewport, const Vec2 &scroll, float top_rate, float bottom_rate) {
+    const float d = viewport.h > 1 ? (bottom_rate - top_rate) / (viewport.h - 1) : 0.0f;
+
+    for (int32_t y = 0; y < viewport.h; y++) {
+      table[y].start = Vec2(scroll.x * (top_rate + d * y), scroll.y + y);
+      table[y].step = Vec2(1.0f, 0.0f);
+    }
   }
 
 }
\ No newline at end of file
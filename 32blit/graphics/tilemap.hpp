@@ -3,6 +3,7 @@
 #include <cstdint>
 
 #include "../32blit.hpp"
+#include "../engine/file.hpp"
 #include "../types/size.hpp"
 #include "../types/point.hpp"
 #include "../types/mat3.hpp"
@@ -10,11 +11,85 @@
 
 namespace blit {
 
+  // Where one scanline of a `TileMap` samples the world: the first pixel of
+  // the viewport maps to `start` and each pixel after it moves by `step`
+  struct ScanlineTransform {
+    Vec2          start;
+    Vec2          step;
+  };
+
+  // log2 of a power of two tile size
+  constexpr int32_t tile_shift(int32_t v) {
+    return v > 1 ? 1 + tile_shift(v >> 1) : 0;
+  }
+
+  // Size of the tiles of a `TileMapT` known at compile time, so tile
+  // coordinates are found with constant shifts and masks
+  template<int W, int H>
+  struct TileSize {
+    static_assert(W > 0 && H > 0 && !(W & (W - 1)) && !(H & (H - 1)), "tile sizes must be powers of two");
+
+    static constexpr int32_t w = W;
+    static constexpr int32_t h = H;
+    static constexpr int32_t shift_x = tile_shift(W);
+    static constexpr int32_t shift_y = tile_shift(H);
+
+    TileSize(const Size &) {}
+  };
+
+  // Size of the tiles of a `TileMapT<0, 0>`, chosen at run time
+  template<>
+  struct TileSize<0, 0> {
+    int32_t       w, h;
+    int32_t       shift_x, shift_y;
+
+    TileSize(const Size &size);
+  };
+
+  // Where the tiles of a `TileMapT` are in its sprite sheet. Tile IDs run
+  // along rows of the whole sheet, `1 << cols_shift` tiles per row, so a
+  // sheet that isn't a power of two tiles wide has its column count rounded
+  // down, unlike `SpriteSheet::cols`
+  template<typename T>
+  struct TileSheet {
+    const T      &size;
+    int32_t       cols_shift;   // log2 of the tiles per row of the sheet
+    int32_t       cols_mask;
+    int32_t       sheet_w;
+
+    TileSheet(const T &size, const Surface *src) : size(size), cols_shift(tile_shift(src->bounds.w) - size.shift_x), cols_mask((1 << cols_shift) - 1), sheet_w(src->bounds.w) {}
+
+    // sheet coordinate of texel `u`, `v` of a tile once its transform is applied
+    __attribute__((always_inline)) inline Point texel(uint32_t tile_id, uint8_t transform, int32_t u, int32_t v) const {
+      // if this tile has a transform then modify the uv coordinates
+      if (transform) {
+        v = (transform & 0b010) ? (size.h - 1 - v) : v;
+        u = (transform & 0b100) ? (size.w - 1 - u) : u;
+        if (transform & 0b001) { int32_t tmp = u; u = v; v = tmp; }
+      }
+
+      // sprite sheet coordinates for top left corner of sprite
+      return Point(((tile_id & cols_mask) << size.shift_x) + u, ((tile_id >> cols_shift) << size.shift_y) + v);
+    }
+
+    // distance in the sheet between the texels of neighbouring pixels along
+    // a row of a tile
+    __attribute__((always_inline)) inline int32_t step(uint8_t transform) const {
+      int32_t step = (transform & 0b100) ? -1 : 1;
+      return (transform & 0b001) ? step * sheet_w : step;
+    }
+  };
+
   // A `tilemap` describes a grid of tiles with optional transforms
-  struct TileMap {
+  //
+  // Tiles are `TileW` x `TileH` pixels (both powers of two, or 0 to set the
+  // size at run time) and are indexed by `IndexType` so sheets can have more
+  // than 256 tiles. The sprite sheet must be a power of two tiles wide.
+  template<int TileW = 8, int TileH = 8, typename IndexType = uint8_t>
+  struct TileMapT {
     Size          bounds;
 
-    uint8_t      *tiles;
+    IndexType    *tiles;
     uint8_t      *transforms;
     SpriteSheet  *sprites;
     Mat3          transform = Mat3::identity();
@@ -24,19 +99,152 @@ namespace blit {
       REPEAT = 1,         // infinite repeat
       DEFAULT_FILL = 2    // fill with default tile
     } repeat_mode;        // determines what to do when drawing outside of the layer bounds.
-    uint8_t       default_tile_id;
+    IndexType     default_tile_id;
+
+    TileSize<TileW, TileH> tile_size;
 
-    TileMap(uint8_t *tiles, uint8_t *transforms, Size bounds, SpriteSheet *sprites);
+    TileMapT(IndexType *tiles, uint8_t *transforms, Size bounds, SpriteSheet *sprites, Size tile_size = Size(TileW, TileH));
 
     inline int32_t offset(const Point &p); // __attribute__((always_inline));
-    int32_t offset(const int16_t &x, const int16_t &y); // __attribute__((always_inline));
-    uint8_t tile_at(const Point &p); // __attribute__((always_inline));
+    int32_t offset(const int32_t &x, const int32_t &y); // __attribute__((always_inline));
+    IndexType tile_at(const Point &p); // __attribute__((always_inline));
     uint8_t transform_at(const Point &p); // __attribute__((always_inline));
 
+    // tile and transform at an offset from `offset()`, which is one past the
+    // end of the map for the `DEFAULT_FILL` tile
+    __attribute__((always_inline)) inline IndexType tile_at_offset(int32_t o) const { return o < bounds.w * bounds.h ? tiles[o] : default_tile_id; }
+    __attribute__((always_inline)) inline uint8_t transform_at_offset(int32_t o) const { return o < bounds.w * bounds.h ? transforms[o] : 0; }
+
     void draw(Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback);
+    void draw(Surface *dest, Rect viewport, const ScanlineTransform *scanlines);
 
-  //  void mipmap_texture_span(surface *dest, point s, uint16_t c, vec2 swc, vec2 ewc);
+    void mipmap_texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc, Vec2 dy = Vec2(0, 0));
     void texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc);
   };
 
+  extern template struct TileMapT<8, 8, uint8_t>;
+  extern template struct TileMapT<8, 8, uint16_t>;
+  extern template struct TileMapT<16, 16, uint8_t>;
+  extern template struct TileMapT<16, 16, uint16_t>;
+  extern template struct TileMapT<32, 32, uint8_t>;
+  extern template struct TileMapT<32, 32, uint16_t>;
+  extern template struct TileMapT<0, 0, uint8_t>;
+  extern template struct TileMapT<0, 0, uint16_t>;
+
+  using TileMap = TileMapT<8, 8, uint8_t>;
+
+#pragma pack(push, 1)
+  // header of a chunked map file, see `StreamingTileMapT`
+  struct packed_tilemap {
+    uint8_t type[8];
+    uint16_t width;
+    uint16_t height;
+    uint8_t chunk_w;
+    uint8_t chunk_h;
+    uint8_t index_size;
+    uint8_t flags;
+  };
+#pragma pack(pop)
+
+  // A tile map streamed from a chunked map file, for maps too big to keep
+  // in memory
+  //
+  // The file is a `packed_tilemap` header ("CHUNKMAP", the map size and the
+  // chunk size in tiles, bytes per tile index and bit 0 of `flags` set if
+  // there are transforms) followed by the chunks in row order. Each chunk
+  // is its tile indices (little endian) then its transforms, edge chunks
+  // are padded to full size so every chunk can be read with one seek.
+  //
+  // Chunks are read into a fixed number of cache pages that fit `budget`
+  // bytes. `update()` loads the chunks covering the area about to be drawn,
+  // evicting the least recently used, and reads ahead in the direction the
+  // view is moving. Tiles in chunks that aren't loaded are not drawn.
+  template<int TileW = 8, int TileH = 8, typename IndexType = uint8_t>
+  struct StreamingTileMapT {
+    Size          bounds;
+
+    IndexType    *tiles = nullptr;          // cache pages, followed by one tile for `DEFAULT_FILL`
+    uint8_t      *transforms = nullptr;
+    SpriteSheet  *sprites;
+    Mat3          transform = Mat3::identity();
+
+    enum {
+      NONE = 0,           // draw nothing
+      REPEAT = 1,         // infinite repeat
+      DEFAULT_FILL = 2    // fill with default tile
+    } repeat_mode = NONE; // determines what to do when drawing outside of the layer bounds.
+    IndexType     default_tile_id = 0;
+
+    TileSize<TileW, TileH> tile_size;
+
+    Size          chunk_size;               // in tiles
+    uint32_t      budget;                   // bytes for the cache pages
+    uint16_t      pages = 0;
+    uint16_t      read_ahead = 4;           // most chunks read ahead per `update()`
+
+    struct Stats {
+      uint32_t    loads;                    // chunks read for the view
+      uint32_t    prefetches;               // chunks read ahead of the view
+      uint32_t    evictions;
+      uint32_t    misses;                   // chunks of the view that didn't fit in the cache
+    };
+
+    Stats         stats = {};
+
+    StreamingTileMapT(SpriteSheet *sprites, uint32_t budget, Size tile_size = Size(TileW, TileH));
+    StreamingTileMapT(const StreamingTileMapT &) = delete;
+    ~StreamingTileMapT();
+
+    bool open(std::string filename);
+    void update(const Rect &view);
+
+    inline int32_t offset(const Point &p);
+    int32_t offset(const int32_t &x, const int32_t &y);
+    IndexType tile_at(const Point &p);
+    uint8_t transform_at(const Point &p);
+
+    // the `DEFAULT_FILL` tile has its own slot after the cache pages
+    __attribute__((always_inline)) inline IndexType tile_at_offset(int32_t o) const { return tiles[o]; }
+    __attribute__((always_inline)) inline uint8_t transform_at_offset(int32_t o) const { return transforms[o]; }
+
+    void draw(Surface *dest, Rect viewport, std::function<Mat3(uint8_t)> scanline_callback);
+    void draw(Surface *dest, Rect viewport, const ScanlineTransform *scanlines);
+
+    void mipmap_texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc, Vec2 dy = Vec2(0, 0));
+    void texture_span(Surface *dest, Point s, uint16_t c, Vec2 swc, Vec2 ewc);
+
+  private:
+    File                  file;
+    uint32_t              chunk_bytes;      // size of a chunk in the file
+    bool                  has_transforms;
+    int32_t               chunk_shift_x, chunk_shift_y;
+    Size                  chunks;           // map size in chunks
+
+    std::vector<int16_t>  slots;            // page holding each chunk, -1 if not loaded
+    std::vector<int32_t>  page_chunks;      // chunk in each page, -1 if free
+    std::vector<uint32_t> page_used;        // `frame` each page was last needed in
+    uint32_t              frame = 0;
+    Rect                  last_view;
+    uint16_t              ahead_left = 0;   // chunks left to read ahead in this update
+
+    int32_t wrap(int32_t v, int32_t size);
+    void touch(int32_t tx, int32_t ty, int32_t tx2, int32_t ty2, bool ahead);
+    bool load(int32_t chunk, bool ahead);
+  };
+
+  extern template struct StreamingTileMapT<8, 8, uint8_t>;
+  extern template struct StreamingTileMapT<8, 8, uint16_t>;
+  extern template struct StreamingTileMapT<16, 16, uint8_t>;
+  extern template struct StreamingTileMapT<16, 16, uint16_t>;
+  extern template struct StreamingTileMapT<32, 32, uint8_t>;
+  extern template struct StreamingTileMapT<32, 32, uint16_t>;
+  extern template struct StreamingTileMapT<0, 0, uint8_t>;
+  extern template struct StreamingTileMapT<0, 0, uint16_t>;
+
+  using StreamingTileMap = StreamingTileMapT<8, 8, uint8_t>;
+
+  void scanline_transforms(ScanlineTransform *table, const Rect &viewport, const Mat3 &transform);
+  void wave_scanlines(ScanlineTransform *table, const Rect &viewport, const Mat3 &transform, float amplitude, float wavelength, float phase);
+  void parallax_scanlines(ScanlineTransform *table, const Rect &viewport, const Vec2 &scroll, float top_rate, float bottom_rate);
+
 }
\ No newline at end of file
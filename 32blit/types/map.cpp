@@ -1,97 +1,186 @@
 /*! \file mat.cpp
 */
 #include <algorithm>
+#include <cmath>
 #include "map.hpp"
+#include "../graphics/span.hpp"
 
 namespace blit {
 
-  void Map::add_layer(std::string name, std::vector<uint8_t> tiles) {
-    MapLayer &layer = layers[name];
+  /**
+   * Add a layer, or replace the tiles of the layer with the same name.
+   *
+   * \param[in] name
+   * \param[in] tiles Tile indices of the layer, pass with `std::move` to avoid a copy
+   * \return Index of the layer in `layers`
+   */
+  uint32_t Map::add_layer(std::string name, std::vector<uint8_t> tiles) {
+    int32_t index = layer_index(name);
+    if (index == -1) {
+      index = layers.size();
+      layers.emplace_back();
+    }
+
+    MapLayer &layer = layers[index];
     layer.map = this;
-    layer.name = name;
-    layer.tiles = tiles;
+    layer.name = std::move(name);
+    layer.tiles = std::move(tiles);
+
+    return index;
   }
 
+  /**
+   * Find a layer by name, keep the index rather than looking it up again.
+   *
+   * \param[in] name
+   * \return Index of the layer in `layers`, -1 if there isn't one
+   */
+  int32_t Map::layer_index(const std::string &name) {
+    for (uint32_t i = 0; i < layers.size(); i++) {
+      if (layers[i].name == name)
+        return i;
+    }
+
+    return -1;
+  }
+
+  /**
+   * Find a layer by name, the pointer is invalidated by adding a layer.
+   *
+   * \param[in] name
+   * \return The layer, `nullptr` if there isn't one
+   */
+  MapLayer *Map::layer(const std::string &name) {
+    int32_t index = layer_index(name);
+    return index == -1 ? nullptr : &layers[index];
+  }
 
   Map::Map(Rect bounds) : bounds(bounds) {
-    flags.resize(bounds.w * bounds.h);
+    flag_stride = (bounds.w + 31) / 32;
   }
 
   int32_t Map::tile_index(Point p) {
     return this->bounds.contains(p) ? p.x + p.y * this->bounds.w : -1;
   }
 
-  void MapLayer::add_flags(uint8_t t, uint8_t f) {
-    for (uint32_t i = 0; i < this->tiles.size(); i++) {
-      if (this->tiles[i] == t)
-        map->flags[i] |= f;
-    }
-  }
+  /**
+   * Get the tiles covering an area of the map, clipped to the map.
+   *
+   * \param[in] r Area of the map in pixels
+   * \return Tiles covering `r`, including the ones touching its right and bottom edges
+   */
+  Rect Map::tile_rect(Rect r) {
+    int32_t minx = std::max(r.x >> 3, bounds.x);
+    int32_t miny = std::max(r.y >> 3, bounds.y);
+    int32_t maxx = std::min((r.x + r.w) >> 3, bounds.x + bounds.w - 1);
+    int32_t maxy = std::min((r.y + r.h) >> 3, bounds.y + bounds.h - 1);
 
-  void MapLayer::mipmap_texture_span(Surface *dest, Point s, uint16_t c, Surface *sprites, Vec2 swc, Vec2 ewc) {
-    // calculate the mipmap index to use for drawing
-    float span_length = (ewc - swc).length();
-    float mipmap = ((span_length / float(c)) / 2.0f);
-    uint16_t mipmap_index = floorf(mipmap);
-    uint8_t blend = (mipmap - floorf(mipmap)) * 255;
+    if (maxx < minx || maxy < miny)
+      return Rect(0, 0, 0, 0);
 
-    mipmap_index = mipmap_index >= (int)sprites->mipmaps.size() ? sprites->mipmaps.size() - 1 : mipmap_index;
-    mipmap_index = mipmap_index < 0 ? 0 : mipmap_index;
+    return Rect(minx, miny, maxx - minx + 1, maxy - miny + 1);
+  }
 
-    dest->alpha = 255;
-    texture_span(dest, s, c, sprites->mipmaps[mipmap_index], swc, ewc, mipmap_index);
+  // sets `f` on every tile of `layer` with a tile index that `match` is true for
+  static void flag_tiles(MapLayer *layer, const bool *match, uint8_t f) {
+    Map *map = layer->map;
+    int32_t count = std::min(int32_t(layer->tiles.size()), map->bounds.w * map->bounds.h);
 
-    if (++mipmap_index < sprites->mipmaps.size()) {
-      dest->alpha = blend;
-      texture_span(dest, s, c, sprites->mipmaps[mipmap_index], swc, ewc, mipmap_index);
+    for (int32_t i = 0; i < count; i++) {
+      if (match[layer->tiles[i]])
+        map->set_flags(Point(map->bounds.x + i % map->bounds.w, map->bounds.y + i / map->bounds.w), f);
     }
   }
 
-  void MapLayer::texture_span(Surface *dest, Point s, uint16_t c, Surface *sprites, Vec2 swc, Vec2 ewc, uint8_t mipmap_index = 0) {
-    /*BlendBlitFunc bbf = dest->bbf[static_cast<uint8_t>(sprites->format)];
+  void MapLayer::add_flags(uint8_t t, uint8_t f) {
+    bool match[256] = {};
+    match[t] = true;
 
-    int world_size = map->bounds.w * 8;
-    int tile_size = 8 >> mipmap_index;
+    flag_tiles(this, match, f);
+  }
 
-    Vec2 wc = swc;
+  // draws a span of the layer from the level of detail `lod` of `sprites`
+  static void layer_span(MapLayer *layer, Surface *dest, Point s, uint16_t c, Surface *sprites, Vec2 swc, Vec2 ewc, float lod) {
     Vec2 dwc = (ewc - swc) / float(c);
-    for (int x = s.x; x < s.x + c; x++) {
-      if (wc.x >= 0 && wc.x < world_size && wc.y >= 0 && wc.y < world_size) {
-        Point pt(wc.x / 8, wc.y / 8); // tile point
+    if (!steppable(swc, dwc))
+      return;
 
-        int16_t tile_id = tile_at(pt) - 1;
+    SpanStepper step(swc, dwc);
 
-        if (tile_id != -1) {
-          Point sp(
-            (tile_id & 0b1111) * tile_size,
-            (tile_id / 16) * tile_size
-          ); // sprite sheet coordinates
+    Map *map = layer->map;
+    Point uv[span_chunk];
 
-          Point uv(
-            (uint8_t(wc.x) & 0b111) >> mipmap_index,
-            (uint8_t(wc.y) & 0b111) >> mipmap_index
-          ); // texture coordinates
+    for (int32_t cx = 0; cx < c; cx += span_chunk) {
+      int32_t n = std::min(span_chunk, c - cx);
 
-          // apply uv transform for tile
-          uint8_t transform = transform_at(pt);
-          if (transform & 0b010) { uv.y = (tile_size - 1) - uv.y; }
-          if (transform & 0b100) { uv.x = (tile_size - 1) - uv.x; }
-          if (transform & 0b001) { uint8_t tmp = uv.x; uv.x = uv.y; uv.y = tmp; }
+      for (int32_t i = 0; i < n; i++, step.next()) {
+        Point wc = step.point();
 
-          Point t = sp + uv;
+        int32_t ti = map->tile_index(Point(wc.x >> 3, wc.y >> 3));
+        int16_t tile_id = ti == -1 ? -1 : layer->tiles[ti] - 1;
 
-          bbf(sprites, sprites->offset(t), dest, dest->offset(x, s.y), 1, 1);
+        if (tile_id == -1) {
+          uv[i].x = -1;
+          continue;
         }
+
+        Point sp(
+          (tile_id & 0b1111) * 8,
+          (tile_id / 16) * 8
+        ); // sprite sheet coordinates
+
+        Point tc(wc.x & 0b111, wc.y & 0b111); // texture coordinates
+
+        // apply uv transform for tile
+        uint8_t transform = layer->transforms.empty() ? 0 : layer->transforms[ti];
+        if (transform & 0b010) { tc.y = 7 - tc.y; }
+        if (transform & 0b100) { tc.x = 7 - tc.x; }
+        if (transform & 0b001) { std::swap(tc.x, tc.y); }
+
+        uv[i] = sp + tc;
       }
 
-      wc += dwc;
-    }  */
+      dest->mipmap_span(sprites, Point(s.x + cx, s.y), n, uv, lod);
+    }
   }
 
-  void MapLayer::add_flags(std::vector<uint8_t> ts, uint8_t f) {
-    for (auto t : ts) {
-      this->add_flags(t, f);
-    }
+  /**
+   * Draw a span of the layer, blending between the two mipmaps of `sprites`
+   * nearest the scale the layer is drawn at.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] sprites Sprite sheet, with mipmaps from `Surface::generate_mipmaps`.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   * \param[in] dy Change in world coordinate from one span to the next, used with the span's own step to choose the mipmap level.
+   */
+  void MapLayer::mipmap_texture_span(Surface *dest, Point s, uint16_t c, Surface *sprites, Vec2 swc, Vec2 ewc, Vec2 dy) {
+    layer_span(this, dest, s, c, sprites, swc, ewc, mipmap_lod((ewc - swc) / float(c), dy));
+  }
+
+  /**
+   * Draw a span of the layer from a single mipmap of `sprites`.
+   *
+   * \param[in] dest Destination surface.
+   * \param[in] s Start of the span on `dest`.
+   * \param[in] c Length of the span.
+   * \param[in] sprites Sprite sheet.
+   * \param[in] swc World coordinate at the start of the span.
+   * \param[in] ewc World coordinate at the end of the span.
+   * \param[in] mipmap_index Mipmap to draw from, 0 for the sprite sheet itself.
+   */
+  void MapLayer::texture_span(Surface *dest, Point s, uint16_t c, Surface *sprites, Vec2 swc, Vec2 ewc, uint8_t mipmap_index) {
+    layer_span(this, dest, s, c, sprites, swc, ewc, mipmap_index);
+  }
+
+  void MapLayer::add_flags(const std::vector<uint8_t> &ts, uint8_t f) {
+    bool match[256] = {};
+    for (auto t : ts)
+      match[t] = true;
+
+    flag_tiles(this, match, f);
   }
 
   uint8_t MapLayer::tile_at(Point p) {
@@ -104,32 +193,124 @@ namespace blit {
     return ti == -1 ? 0 : transforms[ti];
   }
 
+  /**
+   * Add flags to a tile.
+   *
+   * \param[in] p Tile position in the map
+   * \param[in] f Flags to set
+   */
+  void Map::set_flags(Point p, uint8_t f) {
+    if (!bounds.contains(p))
+      return;
+
+    p -= bounds.tl();
+    uint32_t o = (p.x >> 5) + p.y * flag_stride;
+
+    for (int b = 0; b < 8; b++) {
+      if (!(f & (1 << b)))
+        continue;
+
+      if (flag_planes[b].empty())
+        flag_planes[b].resize(flag_stride * bounds.h);
+
+      flag_planes[b][o] |= 1u << (p.x & 31);
+    }
+  }
+
   uint8_t Map::get_flags(Point p) {
-    int32_t ti = tile_index(p);
-    return ti == -1 ? 0 : this->flags[ti];
+    if (!bounds.contains(p))
+      return 0;
+
+    p -= bounds.tl();
+    uint32_t o = (p.x >> 5) + p.y * flag_stride;
+
+    uint8_t f = 0;
+    for (int b = 0; b < 8; b++) {
+      if (!flag_planes[b].empty())
+        f |= ((flag_planes[b][o] >> (p.x & 31)) & 1) << b;
+    }
+
+    return f;
   }
 
   bool Map::has_flag(Point p, uint8_t f) {
-    return this->get_flags(p) & f;
+    if (!bounds.contains(p))
+      return false;
+
+    p -= bounds.tl();
+    uint32_t o = (p.x >> 5) + p.y * flag_stride;
+
+    for (int b = 0; b < 8; b++) {
+      if ((f & (1 << b)) && !flag_planes[b].empty() && (flag_planes[b][o] & (1u << (p.x & 31))))
+        return true;
+    }
+
+    return false;
   }
 
   void Map::tiles_in_rect(Rect vp, std::function<void(Point)> f) {
-    int minx = vp.x / 8;
-    int maxx = ((vp.x + vp.w) / 8);
-    int miny = vp.y / 8;
-    int maxy = ((vp.y + vp.h) / 8);
+    for_each_tile_in_rect(vp, f);
+  }
+
+  /**
+   * Find the first tile with any of a set of flags in an area of the map.
+   *
+   * Tests a row of up to 32 tiles at a time and stops at the first match,
+   * use it instead of `has_flag` for every tile of `tiles_in_rect` when
+   * only whether there is a match matters, such as for collisions.
+   *
+   * \param[in] r Area of the map in pixels, as for `tiles_in_rect`
+   * \param[in] f Flags to look for
+   * \param[out] found Position of the first matching tile, in row order
+   * \return `true` if a tile has any of `f`
+   */
+  bool Map::find_flag_in_rect(Rect r, uint8_t f, Point *found) {
+    Rect t = tile_rect(r);
+    if (t.empty())
+      return false;
+
+    const uint32_t *planes[8];
+    int count = 0;
+    for (int b = 0; b < 8; b++) {
+      if ((f & (1 << b)) && !flag_planes[b].empty())
+        planes[count++] = flag_planes[b].data();
+    }
+
+    if (!count)
+      return false;
 
-    minx = minx < 0 ? 0 : minx;
-    miny = miny < 0 ? 0 : miny;
+    int32_t x0 = t.x - bounds.x, x1 = x0 + t.w - 1;
+    int32_t w0 = x0 >> 5, w1 = x1 >> 5;
+    uint32_t first_mask = ~0u << (x0 & 31);
+    uint32_t last_mask = ~0u >> (31 - (x1 & 31));
 
-    maxx = maxx > bounds.w - 1 ? bounds.w - 1 : maxx;
-    maxy = maxy > bounds.h - 1 ? bounds.h - 1 : maxy;
+    for (int32_t y = t.y - bounds.y; y < t.y - bounds.y + t.h; y++) {
+      uint32_t o = y * flag_stride;
 
-    Point pt;
-    for (pt.y = miny; pt.y <= maxy; pt.y++) {
-      for (pt.x = minx; pt.x <= maxx; pt.x++) {
-        f(pt);
+      for (int32_t w = w0; w <= w1; w++) {
+        uint32_t bits = 0;
+        for (int i = 0; i < count; i++)
+          bits |= planes[i][o + w];
+
+        if (w == w0) bits &= first_mask;
+        if (w == w1) bits &= last_mask;
+
+        if (bits) {
+          if (found) {
+            int32_t x = w << 5;
+            while (!(bits & 1)) {
+              bits >>= 1;
+              x++;
+            }
+
+            *found = Point(bounds.x + x, bounds.y + y);
+          }
+
+          return true;
+        }
       }
     }
+
+    return false;
   }
 }
\ No newline at end of file
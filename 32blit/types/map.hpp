@@ -19,30 +19,61 @@ namespace blit {
     std::vector<uint8_t> transforms;
 
     void add_flags(uint8_t t, uint8_t f);
-    void add_flags(std::vector<uint8_t> t, uint8_t f);
+    void add_flags(const std::vector<uint8_t> &t, uint8_t f);
 
     uint8_t tile_at(blit::Point p);
     uint8_t transform_at(blit::Point p);
 
-    void mipmap_texture_span(blit::Surface *dest, blit::Point s, uint16_t c, blit::Surface *sprites, Vec2 swc, Vec2 ewc);
-    void texture_span(blit::Surface *dest, blit::Point s, uint16_t c, blit::Surface *sprites, Vec2 swc, Vec2 ewc, uint8_t mipmap_index);
+    void mipmap_texture_span(blit::Surface *dest, blit::Point s, uint16_t c, blit::Surface *sprites, Vec2 swc, Vec2 ewc, Vec2 dy = Vec2(0, 0));
+    void texture_span(blit::Surface *dest, blit::Point s, uint16_t c, blit::Surface *sprites, Vec2 swc, Vec2 ewc, uint8_t mipmap_index = 0);
   };
 
   struct Map {
     blit::Rect bounds;
 
-    std::map<std::string, MapLayer> layers;
-    std::vector<uint8_t> flags;
+    // layers in the order they were added, the index returned by
+    // `add_layer()` is a handle to use instead of looking layers up by name
+    std::vector<MapLayer> layers;
+
+    // one plane per flag bit with a bit per tile, rows are padded to whole
+    // words so a row of tiles can be tested a word at a time, planes stay
+    // empty until a tile has their flag
+    std::vector<uint32_t> flag_planes[8];
+    int32_t flag_stride;  // words per row of a plane
 
     Map(blit::Rect bounds);
 
-    void add_layer(std::string name, std::vector<uint8_t> tiles);
+    uint32_t add_layer(std::string name, std::vector<uint8_t> tiles);
+    int32_t layer_index(const std::string &name);
+    MapLayer *layer(const std::string &name);
+
     int32_t tile_index(blit::Point p);
+    blit::Rect tile_rect(blit::Rect r);
 
+    void set_flags(blit::Point p, uint8_t f);
     uint8_t get_flags(blit::Point p);
     bool has_flag(blit::Point p, uint8_t f);
 
     void tiles_in_rect(blit::Rect r, std::function<void(blit::Point)> f);
+    bool find_flag_in_rect(blit::Rect r, uint8_t f, blit::Point *found = nullptr);
+
+    /**
+     * Call `f(Point)` for every tile in an area of the map, like
+     * `tiles_in_rect` but without going through a `std::function`.
+     *
+     * \param[in] r Area of the map in pixels
+     * \param[in] f
+     */
+    template<typename F>
+    void for_each_tile_in_rect(blit::Rect r, F f) {
+      blit::Rect t = tile_rect(r);
 
+      blit::Point pt;
+      for (pt.y = t.y; pt.y < t.y + t.h; pt.y++) {
+        for (pt.x = t.x; pt.x < t.x + t.w; pt.x++) {
+          f(pt);
+        }
+      }
+    }
   };
 }
\ No newline at end of file
@@ -0,0 +1,88 @@
+// Micro-benchmark for the span blend kernels
+//
+// Times the most common full screen operations every frame and shows the
+// results with the profiler overlay. Build with -DBLIT_NO_SIMD to compare
+// against the scalar kernels.
+//
+// Button			Function
+// =====================================================
+// A					Toggle the global alpha used for the overlay blit
+
+
+#include "blend-test.hpp"
+#include "engine/profiler.hpp"
+
+using namespace blit;
+
+#define SCREEN_WIDTH 320
+#define SCREEN_HEIGHT 240
+
+Profiler 			g_profiler;
+ProfilerProbe *g_pClearProbe;
+ProfilerProbe *g_pOverlayProbe;
+ProfilerProbe *g_pBlitProbe;
+
+uint8_t overlay_data[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+Surface overlay(overlay_data, PixelFormat::RGBA, Size(SCREEN_WIDTH, SCREEN_HEIGHT));
+
+bool g_bGlobalAlpha = false;
+
+void init()
+{
+	set_screen_mode(ScreenMode::hires);
+
+	g_profiler.set_display_size(SCREEN_WIDTH, SCREEN_HEIGHT);
+	g_profiler.set_rows(3);
+	g_profiler.set_alpha(200);
+	g_profiler.display_history(false);
+
+	g_pClearProbe 	= g_profiler.add_probe("Clear", 300);
+	g_pOverlayProbe = g_profiler.add_probe("Alpha overlay", 300);
+	g_pBlitProbe 		= g_profiler.add_probe("RGBA blit", 300);
+
+	g_profiler.setup_graph_element(Profiler::dmCur, true, true, Pen(0,255,0));
+	g_profiler.setup_graph_element(Profiler::dmAvg, true, true, Pen(0,255,255));
+
+	// gradient with varying per pixel alpha
+	Pen *p = (Pen *)overlay.data;
+	for (int y = 0; y < SCREEN_HEIGHT; y++) {
+		for (int x = 0; x < SCREEN_WIDTH; x++) {
+			*p++ = Pen(x * 255 / SCREEN_WIDTH, y * 255 / SCREEN_HEIGHT, 128, (x + y) & 0xff);
+		}
+	}
+}
+
+void render(uint32_t time)
+{
+	static uint32_t lastButtons = 0;
+
+	if(buttons & (buttons ^ lastButtons) & Button::A)
+		g_bGlobalAlpha = !g_bGlobalAlpha;
+
+	lastButtons = buttons;
+
+	screen.alpha = 255;
+
+	g_pClearProbe->start();
+	screen.pen = Pen(20, 30, 40, 255);
+	screen.clear();
+	g_pClearProbe->store_elapsed_us();
+
+	g_pOverlayProbe->start();
+	screen.pen = Pen(255, 0, 0, 128);
+	screen.rectangle(screen.clip);
+	g_pOverlayProbe->store_elapsed_us();
+
+	g_pBlitProbe->start();
+	screen.alpha = g_bGlobalAlpha ? 160 : 255;
+	screen.blit(&overlay, Rect(0, 0, SCREEN_WIDTH, SCREEN_HEIGHT), Point(0, 0));
+	screen.alpha = 255;
+	g_pBlitProbe->store_elapsed_us();
+
+	g_profiler.set_graph_time(2000);
+	g_profiler.display_probe_overlay(1);
+}
+
+void update(uint32_t time)
+{
+}
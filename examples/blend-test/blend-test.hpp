@@ -0,0 +1 @@
+#include "32blit.hpp"
@@ -25,6 +25,7 @@ SpriteSheet *sprites;
 SpriteSheet *water;
 
 Map map(Rect(0, 0, 128, 128));
+MapLayer *ground;
 
 struct object {
   Vec2 pos;
@@ -66,8 +67,8 @@ float rad2deg(float r) {
 }
 
 void init() {
-  map.add_layer("ground", layer);
-  map.layers["ground"].transforms = layer_transforms;
+  ground = &map.layers[map.add_layer("ground", layer)];
+  ground->transforms = layer_transforms;
 
   // Load our map sprites into the __sprites space we've reserved
   sprites = SpriteSheet::load(packed_data, __sprites);
@@ -79,7 +80,7 @@ void init() {
   Point p;
   for (p.y = 0; p.y < 128; p.y++) {
     for (p.x = 0; p.x < 128; p.x++) {
-      int16_t tid = map.layers["ground"].tile_at(p);
+      int16_t tid = ground->tile_at(p);
       if (tid == 27) {
         objects.emplace_back(
           Vec2(p.x * 8 + 4, p.y * 8 + 4),
@@ -158,7 +159,8 @@ void render(uint32_t time_ms) {
 
   screen.blit(water, Rect(0, 0, 64, 64), Point(0, 50));
 
-  mode7(&screen, sprites, &map.layers["ground"], fov, angle, pos, near, far, vp);
+  screen.alpha = 255;
+  mode7(&screen, sprites, ground, fov, angle, pos, near, far, vp);
 
   std::vector<DrawObject> drawables = drawObjects(objects);
   std::sort(drawables.begin(), drawables.end()); // sort them so they draw in order
@@ -200,7 +202,7 @@ void render(uint32_t time_ms) {
     for (mmp.x = 0; mmp.x < 64; mmp.x++) {
       Point tp = mmp * 2.0f;
       
-      int16_t tile_id = map.layers["ground"].tile_at(tp) - 1;
+      int16_t tile_id = ground->tile_at(tp) - 1;
 
       if (tile_id != -1) {
         Point sp(
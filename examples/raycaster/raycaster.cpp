@@ -105,13 +105,15 @@ void init() {
 	//engine::update = ::update;
 	screen.sprites = SpriteSheet::load(packed_data);
 
-	map.add_layer("walls", map_data_walls);
-	map_layer_walls = &map.layers["walls"];
+	uint32_t walls_layer = map.add_layer("walls", map_data_walls);
+	uint32_t floor_layer = map.add_layer("floor", map_data_floor);
+
+	// pointers to layers are only stable once they have all been added
+	map_layer_walls = &map.layers[walls_layer];
 	map_layer_walls->add_flags({ 1, 2, 3, 4, 5 }, TileFlags::WALL);
 	map_layer_walls->add_flags({ 1, 2, 3, 4, 5 }, TileFlags::NO_GRASS);
 
-	map.add_layer("floor", map_data_floor);
-	map_layer_floor = &map.layers["floor"];
+	map_layer_floor = &map.layers[floor_layer];
 	map_layer_floor->add_flags({ 3, 4, 5 }, TileFlags::NO_GRASS);
 
 	//my_sprites.s.load_from_packed(packed_data);